@@ -0,0 +1,34 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Asynchronous logging: log lines are copied into ring buffer
+ * and written out by separate thread.
+ */
+
+/* where the line goes */
+#define ALOG_FILE	1
+#define ALOG_SYSLOG	2
+#define ALOG_STDERR	4
+
+void asynclog_setup(void);
+void asynclog_stop(void);
+bool asynclog_active(void);
+void asynclog_write(const char *line, unsigned len, unsigned msg_ofs,
+		    unsigned msg_len, int dest, int prio);
+void asynclog_reopen(void);
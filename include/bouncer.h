@@ -45,7 +45,9 @@ enum SocketState {
 	SV_IDLE,		/* pool->idle_server_list */
 	SV_ACTIVE,		/* pool->active_server_list */
 	SV_USED,		/* pool->used_server_list */
-	SV_TESTED		/* pool->tested_server_list */
+	SV_TESTED,		/* pool->tested_server_list */
+	SV_CANCEL,		/* pool->cancel_server_list */
+	SV_LISTEN		/* pool->listen_server_list */
 };
 
 enum PauseMode {
@@ -67,6 +69,7 @@ typedef enum SocketState SocketState;
 typedef struct PktHdr PktHdr;
 
 extern int cf_sbuf_len;
+extern int cf_huge_pages;
 
 #include "aatree.h"
 #include "hash.h"
@@ -89,6 +92,13 @@ extern int cf_sbuf_len;
 #include "stats.h"
 #include "takeover.h"
 #include "janitor.h"
+#include "mux.h"
+#include "notify.h"
+#include "digest.h"
+#include "asynclog.h"
+#include "evlog.h"
+#include "loopstat.h"
+#include "usdt.h"
 
 /* to avoid allocations will use static buffers */
 #define MAX_DBNAME	64
@@ -112,6 +122,11 @@ extern int cf_sbuf_len;
 #define POOL_SESSION	0
 #define POOL_TX		1
 #define POOL_STMT	2
+#define POOL_MUX	3
+
+/* how to check idle servers */
+#define CHECK_QUERY	0
+#define CHECK_SOCKET	1
 
 /* old style V2 header: len:4b code:4b */
 #define OLD_HEADER_LEN	8
@@ -167,6 +182,11 @@ struct PgPool {
 	StatList used_server_list;	/* server just unlinked from clients */
 	StatList tested_server_list;	/* server in testing process */
 	StatList new_server_list;	/* servers in login phase */
+	StatList cancel_server_list;	/* connections sending cancel requests */
+	StatList listen_server_list;	/* LISTEN connection for channel_list */
+	List channel_list;		/* channels that clients LISTEN on */
+	uint32_t listen_sent;		/* queries sent to listener */
+	uint32_t listen_done;		/* answers got from listener */
 
 	PgStats stats;
 	PgStats newer_stats;
@@ -184,6 +204,20 @@ struct PgPool {
 	usec_t last_connect_time;
 	unsigned last_connect_failed:1;
 
+	/* adaptive pool size */
+	int target_size;		/* current server count target */
+	usec_t adapt_time;		/* last adjustment */
+	usec_t adapt_query_time;	/* server-side query time since last adjustment */
+	uint64_t adapt_query_count;
+	usec_t adapt_base_query;	/* average query time without congestion */
+	unsigned adapt_connect_failed:1;/* connect failed since last adjustment */
+
+	usec_t service_time;		/* moving average of server-side query time */
+
+	DigestTable *digests;		/* query digest stats, allocated on first query */
+
+	uint32_t id;			/* unique id for event log */
+
 	unsigned welcome_msg_ready:1;
 };
 
@@ -255,20 +289,28 @@ struct PgDatabase {
  * ->state corresponds to various lists the struct can be at.
  */
 struct PgSocket {
+	/*
+	 * Hot part, touched on every packet.  Together with start
+	 * of sbuf it fits into first two cache lines.
+	 */
 	List head;		/* list header */
 	PgSocket *link;		/* the dest of packets */
 	PgPool *pool;		/* parent pool, if NULL not yet assigned */
 
-	PgUser *auth_user;	/* presented login, for client it may differ from pool->user */
-
 	SocketState state:8;	/* this also specifies socket location */
 
 	bool ready:1;		/* server: accepts new query */
 	bool close_needed:1;	/* server: this socket must be closed ASAP */
-	bool setting_vars:1;	/* server: setting client vars */
+	bool setting_vars:1;	/* server: skipping answer to pipelined SET */
 	bool exec_on_connect:1;	/* server: executing connect_query */
+	bool reset_pending:1;	/* server: server_reset_query must be sent before next query */
+	bool resetting:1;	/* server: skipping answer to pipelined reset query */
+	bool timeout_cancel:1;	/* server: query_timeout sent cancel request */
 
 	bool wait_for_welcome:1;/* client: no server yet in pool, cannot send welcome msg */
+	bool muxed:1;		/* client: queries queued on multiplexed server */
+	bool mux_paused:1;	/* client: paused until multiplexed answers are done */
+	bool listen_wait:1;	/* client: paused until listener has done LISTEN */
 
 	bool suspended:1;	/* client/server: if the socket is suspended */
 
@@ -276,19 +318,44 @@ struct PgSocket {
 	bool own_user:1;	/* console client: client with same uid on unix socket */
 	bool wait_for_response:1;/* console client: waits for completion of PAUSE/SUSPEND cmd */
 
-	usec_t connect_time;	/* when connection was made */
+	uint8_t pin_flags;	/* client: PIN_* state that keeps the server linked */
+	uint16_t mux_pending;	/* client: queries in multiplexed server queue */
+	uint16_t mux_size;	/* server: allocated size of mux_queue */
+	uint16_t mux_head;	/* server: position of oldest query in mux_queue */
+	uint16_t mux_count;	/* server: queries in mux_queue */
+	uint32_t digest_hash;	/* client: digest of running query, 0 if not tracked */
+
 	usec_t request_time;	/* last activity time */
 	usec_t query_start;	/* query start moment */
+	PgSocket **mux_queue;	/* server: clients in order of queued queries */
+
+	SBuf sbuf;		/* stream buffer */
+
+	/*
+	 * Cold part, used on login, on transaction boundary
+	 * and by admin console.
+	 */
+	PgUser *auth_user;	/* presented login, for client it may differ from pool->user */
+	usec_t connect_time;	/* when connection was made */
+	uint32_t id;		/* unique id for event log */
 
 	uint8_t cancel_key[BACKENDKEY_LEN]; /* client: generated, server: remote */
 	PgAddr remote_addr;	/* ip:port for remote endpoint */
 	PgAddr local_addr;	/* ip:port for local endpoint */
 
+	uint32_t vars_hash;	/* server: varcache_hash() of vars when idle */
 	VarCache vars;		/* state of interesting server parameters */
 
-	SBuf sbuf;		/* stream buffer, must be last */
+	NotifyClient *notify;	/* client: LISTEN subscriptions, if any */
+	uint64_t digest_bytes;	/* client: result bytes of running query */
+	usec_t digest_start;	/* client: when digested query was sent */
+	usec_t link_time;	/* client: when running request got its server */
+	char *query_text;	/* client: start of running query, for log_slow_queries */
 };
 
+/* PgSocket is allocated on cache line boundary */
+#define CACHELINE_SIZE	64
+
 #define RAW_IOBUF_SIZE	offsetof(IOBuf, buf)
 #define IOBUF_SIZE	(RAW_IOBUF_SIZE + cf_sbuf_len)
 
@@ -323,20 +390,32 @@ extern usec_t cf_res_pool_timeout;
 
 extern char * cf_autodb_connstr;
 extern usec_t cf_autodb_idle_timeout;
+extern usec_t cf_mem_reclaim_timeout;
 
 extern usec_t cf_suspend_timeout;
 extern usec_t cf_server_lifetime;
 extern usec_t cf_server_idle_timeout;
 extern char * cf_server_reset_query;
+extern int cf_server_reset_pipeline;
 extern char * cf_server_check_query;
 extern usec_t cf_server_check_delay;
+extern int cf_server_check_mode;
+extern usec_t cf_server_check_query_delay;
 extern usec_t cf_server_connect_timeout;
 extern usec_t cf_server_login_retry;
 extern usec_t cf_query_timeout;
+extern usec_t cf_query_timeout_grace;
 extern usec_t cf_query_wait_timeout;
 extern usec_t cf_client_idle_timeout;
 extern usec_t cf_client_login_timeout;
 extern int cf_server_round_robin;
+extern int cf_max_cancel_conn;
+extern int cf_adaptive_pool_min;
+extern int cf_adaptive_pool_max_wait;
+extern int cf_admission_max_wait;
+extern int cf_mux_depth;
+extern int cf_session_pinning;
+extern int cf_listen_fanout;
 
 extern int cf_auth_type;
 extern char *cf_auth_file;
@@ -345,10 +424,12 @@ extern char *cf_logfile;
 extern char *cf_pidfile;
 
 extern char *cf_ignore_startup_params;
+extern char *cf_track_extra_params;
 
 extern char *cf_admin_users;
 extern char *cf_stats_users;
 extern int cf_stats_period;
+extern int cf_query_digest_size;
 
 extern int cf_pause_mode;
 extern int cf_shutdown;
@@ -362,13 +443,23 @@ extern int cf_tcp_keepintvl;
 extern int cf_tcp_socket_buffer;
 extern int cf_tcp_defer_accept;
 
+extern int cf_client_spool_size;
+extern int cf_client_spool_file_size;
+extern char *cf_client_spool_dir;
+
 extern int cf_log_connections;
 extern int cf_log_disconnections;
 extern int cf_log_pooler_errors;
+extern int cf_log_slow_queries;
+extern int cf_log_slow_queries_rate;
+extern int cf_log_async_buffer;
+extern char *cf_event_log_file;
+extern int cf_event_log_size;
 
 extern ConfElem bouncer_params[];
 
 extern usec_t g_suspend_start;
+extern bool g_suspend_buffers;
 
 static inline PgSocket * _MUSTCHECK
 pop_socket(StatList *slist)
@@ -16,6 +16,17 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* session state that keeps client on its server, PgSocket->pin_flags */
+#define PIN_SET		1	/* session-level SET */
+#define PIN_PREPARE	2	/* named prepared statements */
+#define PIN_TEMP	4	/* temp tables */
+#define PIN_LISTEN	8	/* LISTEN */
+#define PIN_LOCK	16	/* session-level advisory locks */
+
+/* how much of query text is kept for log_slow_queries */
+#define SLOW_QUERY_LEN	256
+
+void log_slow_query(PgSocket *client, usec_t total, usec_t wait);
 bool client_proto(SBuf *sbuf, SBufEvent evtype, MBuf *pkt)  _MUSTCHECK;
 bool set_pool(PgSocket *client, const char *dbname, const char *username) _MUSTCHECK;
 
@@ -0,0 +1,34 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Query digest statistics: normalized query text is hashed into
+ * fixed-size per-pool table, which keeps approximately most
+ * frequent queries.
+ */
+
+/* max length of normalized query text kept in table */
+#define DIGEST_QUERY_LEN 256
+
+typedef struct DigestTable DigestTable;
+
+void digest_client_query(PgSocket *client, PktHdr *pkt);
+void digest_query_done(PgSocket *client);
+void digest_free(PgPool *pool);
+void digest_maint(PgPool *pool);
+bool admin_show_digests(PgSocket *admin, StatList *pool_list)  _MUSTCHECK;
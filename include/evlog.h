@@ -0,0 +1,72 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Binary event log of connection lifecycle.
+ */
+
+enum EvLogType {
+	EVLOG_CLIENT_ACCEPT = 1,	/* extra: 1 if taken over */
+	EVLOG_CLIENT_LOGIN,		/* extra: login time, usec */
+	EVLOG_CLIENT_CLOSE,		/* extra: age, sec, text: reason template */
+	EVLOG_SERVER_CONNECT,		/* extra: EVLOG_CONN_* */
+	EVLOG_SERVER_LOGIN,		/* extra: login time, usec */
+	EVLOG_SERVER_CLOSE,		/* extra: age, sec, text: reason template */
+	EVLOG_SERVER_LINK,		/* sock: client, extra: server id */
+	EVLOG_SERVER_RELEASE,		/* extra: client id, 0 if none */
+	EVLOG_POOL_CREATE,		/* text: db/user */
+	EVLOG_START,			/* extra: pid */
+};
+
+/* what kind of server connection was launched */
+enum EvLogConn {
+	EVLOG_CONN_NORMAL,
+	EVLOG_CONN_CANCEL,
+	EVLOG_CONN_LISTEN,
+	EVLOG_CONN_TAKEOVER,
+};
+
+/* max length of text in text table, with zero byte */
+#define EVLOG_TEXT_LEN	64
+
+/* record in ring, layout is read by test/evlogdump.py */
+struct EvLogRecord {
+	uint64_t time;		/* usec since epoch */
+	uint32_t sock_id;	/* PgSocket->id */
+	uint32_t pool_id;	/* PgPool->id, 0 if none */
+	uint32_t addr;		/* remote IPv4 address, network order, 0 for unix */
+	uint16_t port;		/* remote port */
+	uint8_t type;		/* EVLOG_* */
+	uint8_t pad;
+	uint16_t text;		/* index in text table, 0 if none */
+	uint16_t pad2;
+	uint32_t extra;		/* event specific */
+};
+
+extern bool evlog_active;
+
+void evlog_setup(void);
+void evlog_write(int type, const PgSocket *sk, PgPool *pool, uint32_t extra, const char *text);
+void evlog_pool_create(PgPool *pool);
+
+/* cheap check so disabled log costs nothing */
+static inline void evlog_event(int type, const PgSocket *sk, PgPool *pool, uint32_t extra, const char *text)
+{
+	if (evlog_active)
+		evlog_write(type, sk, pool, extra, text);
+}
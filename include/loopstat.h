@@ -0,0 +1,68 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Event loop timing: where time of each main loop iteration goes.
+ */
+
+enum LoopPhase {
+	/* callbacks from event_loop() */
+	LOOP_RECV,		/* data from socket */
+	LOOP_SEND,		/* socket writable */
+	LOOP_CONNECT,		/* connect finished */
+	LOOP_ACCEPT,		/* new client */
+	LOOP_TIMER,		/* timers */
+	LOOP_SIGNAL,		/* signal handlers */
+
+	/* nested in callbacks */
+	LOOP_ADMIN,		/* admin console command */
+	LOOP_FULL_MAINT,	/* janitor full maintenance */
+
+	/* main_loop_once() parts */
+	LOOP_WAIT,		/* waiting for events */
+	LOOP_PER_LOOP_MAINT,	/* per_loop_maint() */
+	LOOP_REUSE_OBJECTS,	/* reuse_just_freed_objects() */
+	LOOP_POOLER_MAINT,	/* rescue_timers() and per_loop_pooler_maint() */
+	LOOP_BUSY,		/* whole iteration without waiting */
+
+	LOOP_PHASE_COUNT
+};
+
+/* histogram buckets: <10us, <100us, .. <1s, more */
+#define LOOP_BUCKETS	7
+
+typedef struct LoopStat {
+	uint64_t count;
+	uint64_t total;		/* usec */
+	uint64_t max;		/* usec */
+	uint64_t buckets[LOOP_BUCKETS];
+} LoopStat;
+
+typedef void (*loop_stat_cb_t)(void *arg, const char *name, const LoopStat *st);
+
+usec_t loop_clock(void);
+
+void loop_iter_start(void);
+void loop_events_done(void);
+void loop_phase_done(enum LoopPhase phase);
+void loop_iter_done(void);
+
+void loop_callback(enum LoopPhase phase);
+void loop_nested_done(enum LoopPhase phase, usec_t start);
+
+void loop_stats(loop_stat_cb_t cb, void *arg);
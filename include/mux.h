@@ -0,0 +1,31 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Statement multiplexing: autocommit simple queries from several
+ * clients are pipelined into one server connection.  Answers come
+ * back in same order, so they are routed to clients by counting
+ * ReadyForQuery packets.
+ */
+
+bool mux_query_ok(PgSocket *client, PktHdr *pkt);
+bool mux_send_query(PgSocket *client, PktHdr *pkt)  _MUSTCHECK;
+bool mux_wait(PgSocket *client)  _MUSTCHECK;
+bool mux_server_packet(PgSocket *server, PktHdr *pkt, bool ready)  _MUSTCHECK;
+void mux_forget_client(PgSocket *client);
+void mux_close_server(PgSocket *server, const char *reason);
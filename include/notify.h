@@ -0,0 +1,37 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * LISTEN/NOTIFY fan-out: client LISTENs are served from one shared
+ * listener connection per pool, notifications are copied to all
+ * subscribed clients.
+ */
+
+/* max length of channel name, as NAMEDATALEN in Postgres */
+#define MAX_CHANNEL_NAME 64
+
+typedef struct NotifyClient NotifyClient;
+
+bool notify_query_ok(PgSocket *client, PktHdr *pkt);
+bool notify_client_query(PgSocket *client, PktHdr *pkt)  _MUSTCHECK;
+bool notify_server_ready(PgSocket *server)  _MUSTCHECK;
+bool notify_server_packet(PgSocket *server, PktHdr *pkt)  _MUSTCHECK;
+void notify_forget_client(PgSocket *client);
+void notify_listener_failed(PgPool *pool);
+bool notify_pool_listens(PgPool *pool);
+void notify_flush_pending(void);
@@ -33,9 +33,13 @@ PgDatabase *find_database(const char *name);
 PgUser *find_user(const char *name);
 PgPool *get_pool(PgDatabase *, PgUser *);
 bool find_server(PgSocket *client)		_MUSTCHECK;
+PgSocket *acquire_idle_server(PgSocket *client);
+void pause_client(PgSocket *client);
 bool release_server(PgSocket *server)		/* _MUSTCHECK */;
 bool finish_client_login(PgSocket *client)	_MUSTCHECK;
 bool check_fast_fail(PgSocket *client)		_MUSTCHECK;
+usec_t predict_wait(PgPool *pool);
+bool check_admission(PgSocket *client, bool send_ready)	_MUSTCHECK;
 
 PgSocket * accept_client(int sock, const struct sockaddr_in *addr, bool is_unix) _MUSTCHECK;
 void disconnect_server(PgSocket *server, bool notify, const char *reason, ...) _PRINTF(3, 4);
@@ -48,15 +52,19 @@ PgUser * force_user(PgDatabase *db, const char *username, const char *passwd) _M
 
 void accept_cancel_request(PgSocket *req);
 void forward_cancel_request(PgSocket *server);
+bool cancel_server_query(PgSocket *server);
 
+int pool_target_size(PgPool *pool);
 void launch_new_connection(PgPool *pool);
+void launch_cancel_connection(PgPool *pool);
+void launch_listen_connection(PgPool *pool);
 
 bool use_client_socket(int fd, PgAddr *addr, const char *dbname, const char *username, uint64_t ckey, int oldfd, int linkfd,
-		       const char *client_end, const char *std_string, const char *datestyle, const char *timezone)
-			_MUSTCHECK;
+		       const char *client_end, const char *std_string, const char *datestyle, const char *timezone,
+		       PgSocket **sk_p) _MUSTCHECK;
 bool use_server_socket(int fd, PgAddr *addr, const char *dbname, const char *username, uint64_t ckey, int oldfd, int linkfd,
-		       const char *client_end, const char *std_string, const char *datestyle, const char *timezone)
-			_MUSTCHECK;
+		       const char *client_end, const char *std_string, const char *datestyle, const char *timezone,
+		       PgSocket **sk_p) _MUSTCHECK;
 
 void activate_client(PgSocket *client);
 
@@ -40,6 +40,7 @@ struct PktBuf {
  */
 PktBuf *pktbuf_dynamic(int start_len)	_MUSTCHECK;
 void pktbuf_static(PktBuf *buf, uint8_t *data, int len);
+void pktbuf_free(PktBuf *buf);
 
 /*
  * sending
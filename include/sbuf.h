@@ -41,6 +41,7 @@ typedef enum {
 
 /* fwd def */
 typedef struct SBuf SBuf;
+typedef struct SBufSpool SBufSpool;
 
 /* callback should return true if it used one of sbuf_prepare_* on sbuf,
    false if it used sbuf_pause(), sbuf_close() or simply wants to wait for
@@ -59,9 +60,8 @@ typedef void (*sbuf_libevent_cb)(int, short, void *);
  * protocol handler is called that decides what to do.
  */
 struct SBuf {
-	struct event ev;	/* libevent handle */
-
 	bool is_unix;		/* is it unix socket */
+	bool allow_spool;	/* data for slow socket can be spooled */
 	uint8_t wait_type;	/* track wait state */
 	uint8_t pkt_action;	/* method for handling current pkt */
 
@@ -72,8 +72,14 @@ struct SBuf {
 	sbuf_cb_t proto_cb;	/* protocol callback */
 
 	SBuf *dst;		/* target SBuf for current packet */
+	SBuf *next_dst;		/* target after pending data is sent to dst */
 
 	IOBuf *io;		/* data buffer, lazily allocated */
+
+	SBufSpool *spool;	/* data waiting for socket to become writable */
+
+	/* fields above are used for each packet, so keep them first */
+	struct event ev;	/* libevent handle */
 };
 
 #define sbuf_socket(sbuf) ((sbuf)->sock)
@@ -92,9 +98,18 @@ void sbuf_prepare_skip(SBuf *sbuf, unsigned amount);
 void sbuf_prepare_fetch(SBuf *sbuf, unsigned amount);
 
 bool sbuf_answer(SBuf *sbuf, const void *buf, unsigned len)  _MUSTCHECK;
+bool sbuf_spool_append(SBuf *sbuf, const void *data, unsigned len)  _MUSTCHECK;
+bool sbuf_write_ordered(SBuf *sbuf, const void *data, unsigned len, unsigned mem_limit)  _MUSTCHECK;
 
 bool sbuf_continue_with_callback(SBuf *sbuf, sbuf_libevent_cb cb)  _MUSTCHECK;
 
+/* online restart with buffered data */
+bool sbuf_can_transfer(SBuf *sbuf, SBuf *link);
+bool sbuf_freeze(SBuf *sbuf) _MUSTCHECK;
+unsigned sbuf_get_buffered(SBuf *sbuf, const uint8_t **data_p, unsigned *parse_ofs_p);
+bool sbuf_restore(SBuf *sbuf, const uint8_t *data, unsigned len, unsigned parse_ofs,
+		  unsigned pkt_remain, uint8_t pkt_action) _MUSTCHECK;
+
 /*
  * Returns true if SBuf is has no data buffered
  * and is not in a middle of a packet.
@@ -104,6 +119,12 @@ static inline bool sbuf_is_empty(SBuf *sbuf)
 	return iobuf_empty(sbuf->io) && sbuf->pkt_remain == 0;
 }
 
+/* Returns true if there is spooled data waiting to be sent. */
+static inline bool sbuf_has_spool(SBuf *sbuf)
+{
+	return sbuf->spool != NULL;
+}
+
 static inline bool sbuf_is_closed(SBuf *sbuf)
 {
 	return sbuf->sock == 0;
@@ -3,8 +3,11 @@ typedef struct ObjectCache ObjectCache;
 
 typedef void (*obj_init_fn)(void *obj);
 
+/* objcache_create() flags */
+#define OBJCACHE_ARENA	1	/* carve slabs from huge-page arena */
+
 ObjectCache *objcache_create(const char *name, unsigned obj_size, unsigned align,
-			     obj_init_fn init_func);
+			     obj_init_fn init_func, int flags);
 void objcache_destroy(ObjectCache *cache);
 
 void * obj_alloc(ObjectCache *cache) _MALLOC _MUSTCHECK;
@@ -14,8 +17,10 @@ int objcache_total_count(const ObjectCache *cache);
 int objcache_free_count(const ObjectCache *cache);
 int objcache_active_count(const ObjectCache *cache);
 
+void objcache_reclaim(usec_t min_age);
+
 typedef void (*slab_stat_fn)(void *arg, const char *slab_name,
 			     unsigned size, unsigned free, 
-			     unsigned total);
+			     unsigned total, unsigned reclaimable);
 void objcache_stats(slab_stat_fn fn, void *arg);
 
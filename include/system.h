@@ -87,6 +87,9 @@
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 /* how to specify array with unknown length */
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
@@ -16,6 +16,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* max fds in one SHOW FDS_BINARY message, as SCM_MAX_FD in Linux */
+#define TAKEOVER_MAX_FDS 253
+
 void takeover_init(void);
 bool takeover_login(PgSocket *bouncer) _MUSTCHECK;
 void takeover_login_failed(void);
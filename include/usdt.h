@@ -0,0 +1,49 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Static tracepoints for bpftrace, perf or systemtap.
+ *
+ * Built with --enable-usdt, each probe is a nop instruction with
+ * a note in ELF file, tracer replaces it with breakpoint when
+ * attached.  Otherwise probes and their arguments are left out.
+ *
+ * Probe names use double underscore, which shows up as dash:
+ *   bpftrace -e 'usdt:./pgbouncer:pgbouncer:query__done { ... }'
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define USDT_PROBE1(name, a) DTRACE_PROBE1(pgbouncer, name, a)
+#define USDT_PROBE2(name, a, b) DTRACE_PROBE2(pgbouncer, name, a, b)
+#define USDT_PROBE3(name, a, b, c) DTRACE_PROBE3(pgbouncer, name, a, b, c)
+#define USDT_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pgbouncer, name, a, b, c, d)
+
+#else
+
+#define USDT_PROBE1(name, a) do {} while (0)
+#define USDT_PROBE2(name, a, b) do {} while (0)
+#define USDT_PROBE3(name, a, b, c) do {} while (0)
+#define USDT_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+/* pool id of client that may not have pool yet */
+#define USDT_POOL_ID(sk) ((sk)->pool ? (sk)->pool->id : 0)
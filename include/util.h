@@ -46,6 +46,7 @@ void log_level(const char *level, const char *s, ...)  _PRINTF(2, 3);
 	} while (0)
 
 void close_logfile(void);
+int logfile_handover(void);
 
 /*
  * logging about specific socket
@@ -100,7 +101,10 @@ void get_random_bytes(uint8_t *dest, int len);
 void socket_set_nonblocking(int fd, int val);
 void tune_socket(int sock, bool is_unix);
 
+bool check_socket_alive(int fd, bool is_unix, const char **reason_p);
+
 bool strlist_contains(const char *liststr, const char *str);
+const char *sql_next_word(const char *p, char *buf, unsigned buflen);
 
 const char *format_date(usec_t uval);
 
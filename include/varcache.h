@@ -1,21 +1,28 @@
 
-#define VAR_ENCODING_LEN	16
-#define VAR_DATESTYLE_LEN	32
-#define VAR_TIMEZONE_LEN	36
-#define VAR_STDSTR_LEN		4
+/* max number of tracked parameters, including built-in ones */
+#define VARCACHE_MAX		16
 
 typedef struct VarCache VarCache;
+typedef struct PStr PStr;
 
+/*
+ * Values are interned strings, so equal values share
+ * same PStr and can be compared by pointer.  NULL means unset.
+ */
 struct VarCache {
-	char client_encoding[VAR_ENCODING_LEN];
-	char datestyle[VAR_DATESTYLE_LEN];
-	char timezone[VAR_TIMEZONE_LEN];
-	char std_strings[VAR_STDSTR_LEN];
+	PStr *var_list[VARCACHE_MAX];
+	uint32_t set_mask;	/* parameters given a value, also empty one */
 };
 
+void varcache_init(void);
+bool varcache_reported(VarCache *orig, const char *name);
 bool varcache_set(VarCache *cache, const char *key, const char *value) /* _MUSTCHECK */;
-bool varcache_apply(PgSocket *server, PgSocket *client, bool *changes_p) _MUSTCHECK;
+const char *varcache_get(VarCache *cache, const char *key);
+bool varcache_apply(PgSocket *server, PgSocket *client, PktBuf *dst);
+uint32_t varcache_hash(VarCache *cache);
 void varcache_fill_unset(VarCache *src, PgSocket *dst);
+void varcache_copy(VarCache *dst, VarCache *src);
+void varcache_forget_unreported(VarCache *cache, VarCache *orig);
 void varcache_clean(VarCache *cache);
 void varcache_add_params(PktBuf *pkt, VarCache *vars);
 
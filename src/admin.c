@@ -305,10 +305,10 @@ static bool show_one_fd(PgSocket *admin, PgSocket *sk)
 			   addr->port,
 			   mbuf_get_uint64(&tmp),
 			   sk->link ? sbuf_socket(&sk->link->sbuf) : 0,
-			   v->client_encoding[0] ? v->client_encoding : NULL,
-			   v->std_strings[0] ? v->std_strings : NULL,
-			   v->datestyle[0] ? v->datestyle : NULL,
-			   v->timezone[0] ? v->timezone : NULL);
+			   varcache_get(v, "client_encoding"),
+			   varcache_get(v, "standard_conforming_strings"),
+			   varcache_get(v, "datestyle"),
+			   varcache_get(v, "timezone"));
 }
 
 /* send a row with sendmsg, optionally attaching a fd */
@@ -409,6 +409,237 @@ static bool admin_show_fds(PgSocket *admin, const char *arg)
 	return res;
 }
 
+/*
+ * SHOW FDS_BINARY: same sockets as SHOW FDS, but up to TAKEOVER_MAX_FDS
+ * of them in one DataRow, with all fds attached to it.  The row has
+ * one column: uint16 count, then for each socket:
+ *
+ *   char task ('c', 's' or 'p'), uint32 fd, uint32 linkfd,
+ *   char is_unix, 4 bytes ip, uint16 port, uint64 cancel key,
+ *   user, database, client_encoding, std_strings, datestyle, timezone,
+ *   uint32 buffered length, uint32 parse offset, uint32 pkt_remain,
+ *   char pkt_action, char pin_flags, buffered data
+ *
+ * where strings are char 0 for NULL or char 1 and zero-terminated string.
+ * Buffered data is there only after SUSPEND BUFFERS.
+ */
+
+/* send row early if buffered data makes it large */
+#define BATCH_ROWS_MAX (256*1024)
+
+typedef struct FdBatch {
+	PgSocket *admin;
+	PktBuf *rows;		/* socket info */
+	int count;
+	int fds[TAKEOVER_MAX_FDS];
+} FdBatch;
+
+static void batch_put_string(PktBuf *buf, const char *str)
+{
+	pktbuf_put_char(buf, str ? 1 : 0);
+	if (str)
+		pktbuf_put_string(buf, str);
+}
+
+/* send collected sockets in one message */
+static bool batch_flush(FdBatch *b)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iovec;
+	uint8_t cntbuf[CMSG_SPACE(sizeof(int) * TAKEOVER_MAX_FDS)];
+	PktBuf *pkt;
+	int fd = sbuf_socket(&b->admin->sbuf);
+	int res, pos;
+	bool ok = false;
+
+	if (b->count == 0)
+		return true;
+	if (b->rows->failed)
+		return false;
+
+	pkt = pktbuf_dynamic(b->rows->write_pos + 16);
+	if (!pkt)
+		return false;
+	pktbuf_start_packet(pkt, 'D');
+	pktbuf_put_uint16(pkt, 1);
+	pktbuf_put_uint32(pkt, b->rows->write_pos + 2);
+	pktbuf_put_uint16(pkt, b->count);
+	pktbuf_put_bytes(pkt, b->rows->buf, b->rows->write_pos);
+	pktbuf_finish_packet(pkt);
+	if (pkt->failed)
+		goto out;
+
+	memset(&msg, 0, sizeof(msg));
+	iovec.iov_base = pkt->buf;
+	iovec.iov_len = pkt->write_pos;
+	msg.msg_iov = &iovec;
+	msg.msg_iovlen = 1;
+
+	/* attach fds */
+	if (b->admin->remote_addr.is_unix && b->admin->own_user) {
+		msg.msg_control = cntbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * b->count);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * b->count);
+		memcpy(CMSG_DATA(cmsg), b->fds, sizeof(int) * b->count);
+		msg.msg_controllen = cmsg->cmsg_len;
+	}
+
+	slog_debug(b->admin, "sending socket batch: count=%d, len=%d",
+		   b->count, pkt->write_pos);
+	res = safe_sendmsg(fd, &msg, 0);
+	if (res < 0) {
+		log_error("batch_flush: sendmsg error: %s", strerror(errno));
+		goto out;
+	}
+
+	/* rest of data, fds went with first part */
+	for (pos = res; pos < pkt->write_pos; pos += res) {
+		res = safe_send(fd, pkt->buf + pos, pkt->write_pos - pos, 0);
+		if (res <= 0) {
+			log_error("batch_flush: send error: %s", strerror(errno));
+			goto out;
+		}
+	}
+	ok = true;
+	b->count = 0;
+	b->rows->write_pos = 0;
+out:
+	pktbuf_free(pkt);
+	return ok;
+}
+
+static bool batch_add(FdBatch *b, int fd, char task, const PgAddr *addr, PgSocket *sk)
+{
+	const uint8_t *data = NULL;
+	unsigned len = 0, parse_ofs = 0;
+	MBuf tmp;
+	int i;
+
+	pktbuf_put_char(b->rows, task);
+	pktbuf_put_uint32(b->rows, fd);
+	pktbuf_put_uint32(b->rows, (sk && sk->link) ? sbuf_socket(&sk->link->sbuf) : 0);
+	pktbuf_put_char(b->rows, addr->is_unix);
+	pktbuf_put_bytes(b->rows, &addr->ip_addr, 4);
+	pktbuf_put_uint16(b->rows, addr->port);
+	if (sk) {
+		mbuf_init(&tmp, sk->cancel_key, 8);
+		pktbuf_put_uint64(b->rows, mbuf_get_uint64(&tmp));
+		batch_put_string(b->rows, sk->auth_user ? sk->auth_user->name : NULL);
+		batch_put_string(b->rows, sk->pool ? sk->pool->db->name : NULL);
+		batch_put_string(b->rows, varcache_get(&sk->vars, "client_encoding"));
+		batch_put_string(b->rows, varcache_get(&sk->vars, "standard_conforming_strings"));
+		batch_put_string(b->rows, varcache_get(&sk->vars, "datestyle"));
+		batch_put_string(b->rows, varcache_get(&sk->vars, "timezone"));
+		len = sbuf_get_buffered(&sk->sbuf, &data, &parse_ofs);
+		pktbuf_put_uint32(b->rows, len);
+		pktbuf_put_uint32(b->rows, parse_ofs);
+		pktbuf_put_uint32(b->rows, sk->sbuf.pkt_remain);
+		pktbuf_put_char(b->rows, sk->sbuf.pkt_action);
+		pktbuf_put_char(b->rows, sk->pin_flags);
+		if (len > 0)
+			pktbuf_put_bytes(b->rows, data, len);
+	} else {
+		pktbuf_put_uint64(b->rows, 0);
+		for (i = 0; i < 6; i++)
+			batch_put_string(b->rows, NULL);
+		for (i = 0; i < 3; i++)
+			pktbuf_put_uint32(b->rows, 0);
+		pktbuf_put_char(b->rows, 0);
+		pktbuf_put_char(b->rows, 0);
+	}
+	b->fds[b->count++] = fd;
+
+	if (b->count == TAKEOVER_MAX_FDS || b->rows->write_pos >= BATCH_ROWS_MAX)
+		return batch_flush(b);
+	return true;
+}
+
+static bool batch_add_list(FdBatch *b, StatList *list)
+{
+	List *item;
+	PgSocket *sk;
+
+	statlist_for_each(item, list) {
+		sk = container_of(item, PgSocket, head);
+		if (!batch_add(b, sbuf_socket(&sk->sbuf),
+			       is_server_socket(sk) ? 's' : 'c',
+			       &sk->remote_addr, sk))
+			return false;
+	}
+	return true;
+}
+
+/* Command: SHOW FDS_BINARY */
+static bool admin_show_fds_binary(PgSocket *admin, const char *arg)
+{
+	List *item;
+	PgPool *pool;
+	FdBatch *b;
+	PgAddr addr;
+	int fd_net, fd_unix;
+	bool res;
+
+	if (!admin->admin_user)
+		return admin_error(admin, "admin access needed");
+
+	b = zmalloc(sizeof(*b));
+	if (b)
+		b->rows = pktbuf_dynamic(64 * 1024);
+	if (!b || !b->rows) {
+		free(b);
+		return admin_error(admin, "no mem");
+	}
+	b->admin = admin;
+
+	/* same as SHOW FDS, send it synchronously */
+	socket_set_nonblocking(sbuf_socket(&admin->sbuf), 0);
+
+	SEND_RowDescription(res, admin, "s", "fds");
+
+	get_pooler_fds(&fd_net, &fd_unix);
+	memset(&addr, 0, sizeof(addr));
+	addr.port = cf_listen_port;
+	if (res && fd_net) {
+		addr.ip_addr.s_addr = inet_addr(cf_listen_addr);
+		res = batch_add(b, fd_net, 'p', &addr, NULL);
+	}
+	if (res && fd_unix) {
+		addr.is_unix = 1;
+		addr.ip_addr.s_addr = 0;
+		res = batch_add(b, fd_unix, 'p', &addr, NULL);
+	}
+
+	res = res && batch_add_list(b, &login_client_list);
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		if (pool->db->admin)
+			continue;
+		res = res && batch_add_list(b, &pool->active_client_list);
+		res = res && batch_add_list(b, &pool->waiting_client_list);
+		res = res && batch_add_list(b, &pool->active_server_list);
+		res = res && batch_add_list(b, &pool->idle_server_list);
+		res = res && batch_add_list(b, &pool->used_server_list);
+		res = res && batch_add_list(b, &pool->tested_server_list);
+		res = res && batch_add_list(b, &pool->new_server_list);
+		if (!res)
+			break;
+	}
+	res = res && batch_flush(b);
+	if (res)
+		res = admin_ready(admin, "SHOW");
+
+	socket_set_nonblocking(sbuf_socket(&admin->sbuf), 1);
+
+	pktbuf_free(b->rows);
+	free(b);
+	return res;
+}
+
 /* Command: SHOW DATABASES */
 static bool admin_show_databases(PgSocket *admin, const char *arg)
 {
@@ -551,136 +782,385 @@ static void socket_row(PktBuf *buf, PgSocket *sk, const char *state, bool debug)
 			     pkt_avail, send_avail);
 }
 
-/* Helper for SHOW CLIENTS */
-static void show_socket_list(PktBuf *buf, StatList *list, const char *state, bool debug)
+/*
+ * SHOW CLIENTS/SERVERS/SOCKETS can be huge, so they are produced
+ * in chunks: next chunk is built when previous one is sent, and
+ * admin's further queries are not read meanwhile.  Lists may change
+ * between chunks, so output is not an exact snapshot.
+ */
+
+/* stop adding rows when chunk is that full */
+#define SHOW_CHUNK_SIZE (16*1024)
+#define SHOW_ROW_MAX 1024
+
+/* socket list in pool and its state */
+struct ShowList {
+	unsigned offset;	/* StatList in PgPool */
+	SocketState state;
+	const char *label;
+};
+
+#define SHOW_LIST(field, state, label) { offsetof(PgPool, field), state, label }
+
+static const struct ShowList client_lists[] = {
+	SHOW_LIST(active_client_list, CL_ACTIVE, "active"),
+	SHOW_LIST(waiting_client_list, CL_WAITING, "waiting"),
+	{ 0, 0, NULL }
+};
+
+static const struct ShowList server_lists[] = {
+	SHOW_LIST(active_server_list, SV_ACTIVE, "active"),
+	SHOW_LIST(idle_server_list, SV_IDLE, "idle"),
+	SHOW_LIST(used_server_list, SV_USED, "used"),
+	SHOW_LIST(tested_server_list, SV_TESTED, "tested"),
+	SHOW_LIST(new_server_list, SV_LOGIN, "new"),
+	SHOW_LIST(cancel_server_list, SV_CANCEL, "cancel"),
+	SHOW_LIST(listen_server_list, SV_LISTEN, "listen"),
+	{ 0, 0, NULL }
+};
+
+static const struct ShowList socket_lists[] = {
+	SHOW_LIST(active_client_list, CL_ACTIVE, "cl_active"),
+	SHOW_LIST(waiting_client_list, CL_WAITING, "cl_waiting"),
+	SHOW_LIST(active_server_list, SV_ACTIVE, "sv_active"),
+	SHOW_LIST(idle_server_list, SV_IDLE, "sv_idle"),
+	SHOW_LIST(used_server_list, SV_USED, "sv_used"),
+	SHOW_LIST(tested_server_list, SV_TESTED, "sv_tested"),
+	SHOW_LIST(new_server_list, SV_LOGIN, "sv_login"),
+	SHOW_LIST(cancel_server_list, SV_CANCEL, "sv_cancel"),
+	SHOW_LIST(listen_server_list, SV_LISTEN, "sv_listen"),
+	{ 0, 0, NULL }
+};
+
+static const struct ShowList active_socket_lists[] = {
+	SHOW_LIST(active_client_list, CL_ACTIVE, "cl_active"),
+	SHOW_LIST(waiting_client_list, CL_WAITING, "cl_waiting"),
+	SHOW_LIST(active_server_list, SV_ACTIVE, "sv_active"),
+	SHOW_LIST(idle_server_list, SV_IDLE, "sv_idle"),
+	SHOW_LIST(used_server_list, SV_USED, "sv_used"),
+	SHOW_LIST(tested_server_list, SV_TESTED, "sv_tested"),
+	SHOW_LIST(new_server_list, SV_LOGIN, "sv_login"),
+	{ 0, 0, NULL }
+};
+
+/* state of streamed SHOW command */
+typedef struct ShowStream {
+	List head;		/* in show_stream_list */
+	PgSocket *admin;
+	PktBuf *buf;		/* current chunk */
+	struct event ev;	/* waits for admin socket to be writable */
+
+	const struct ShowList *lists;
+	bool debug;		/* extra columns */
+	bool active_only;	/* only sockets with data in buffers */
+	bool login;		/* login_client_list at the end */
+
+	PgPool *pool;		/* current pool, NULL after last */
+	int pool_pos;		/* position of pool in pool_list */
+	int list;		/* current index in lists, -1 for login_client_list */
+	PgSocket *next;		/* next socket to show, NULL at list end */
+	int pos;		/* position of next in its list */
+	bool done;		/* last chunk built */
+} ShowStream;
+
+static STATLIST(show_stream_list);
+
+static void stream_send_cb(int fd, short flags, void *arg);
+
+static StatList *stream_statlist(ShowStream *st)
+{
+	if (st->list < 0)
+		return &login_client_list;
+	return (StatList *)((char *)st->pool + st->lists[st->list].offset);
+}
+
+static SocketState stream_state(ShowStream *st)
+{
+	return st->list < 0 ? CL_LOGIN : st->lists[st->list].state;
+}
+
+static PgSocket *nth_socket(StatList *list, int n)
 {
 	List *item;
-	PgSocket *sk;
 
 	statlist_for_each(item, list) {
-		sk = container_of(item, PgSocket, head);
-		socket_row(buf, sk, state, debug);
+		if (n-- == 0)
+			return container_of(item, PgSocket, head);
 	}
+	return NULL;
 }
 
-/* Command: SHOW CLIENTS */
-static bool admin_show_clients(PgSocket *admin, const char *arg)
+/*
+ * Socket memory stays mapped even when its slab is reclaimed: slab.c
+ * only does madvise(MADV_DONTNEED), after which the page reads as
+ * zeroes, and state 0 (CL_FREE) fails the state check below.  So a
+ * stale pointer can be checked.  Reclaim must not switch to free()
+ * or munmap().
+ */
+static void stream_revalidate(ShowStream *st)
 {
 	List *item;
 	PgPool *pool;
-	PktBuf *buf = pktbuf_dynamic(256);
-
-	if (!buf) {
-		admin_error(admin, "no mem");
-		return true;
+	int n = 0;
+
+	if (st->pool) {
+		statlist_for_each(item, &pool_list) {
+			pool = container_of(item, PgPool, head);
+			if (pool == st->pool)
+				break;
+			n++;
+		}
+		if (item == &pool_list.head) {
+			/* pool was dropped, continue at same position */
+			st->pool = NULL;
+			n = 0;
+			statlist_for_each(item, &pool_list) {
+				if (n++ == st->pool_pos) {
+					st->pool = container_of(item, PgPool, head);
+					break;
+				}
+			}
+			st->list = (st->pool || !st->login) ? 0 : -1;
+			st->pos = 0;
+			st->next = (st->pool || st->login) ? first_socket(stream_statlist(st)) : NULL;
+			return;
+		}
 	}
+	if (!st->pool && st->list >= 0)
+		return;
 
-	socket_header(buf, false);
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
+	if (st->next && (st->next->state != stream_state(st)
+			 || (st->list >= 0 && st->next->pool != st->pool)))
+		st->next = nth_socket(stream_statlist(st), st->pos);
+}
 
-		show_socket_list(buf, &pool->active_client_list, "active", false);
-		show_socket_list(buf, &pool->waiting_client_list, "waiting", false);
-	}
+/* move to next list, false if all done */
+static bool stream_next_list(ShowStream *st)
+{
+	List *item;
 
-	admin_flush(admin, buf, "SHOW");
+	if (st->list < 0)
+		return false;
+
+	if (st->lists[++st->list].label == NULL) {
+		item = st->pool->head.next;
+		st->pool_pos++;
+		st->list = 0;
+		if (item == &pool_list.head) {
+			st->pool = NULL;
+			if (!st->login)
+				return false;
+			st->list = -1;
+		} else
+			st->pool = container_of(item, PgPool, head);
+	}
+	st->pos = 0;
+	st->next = first_socket(stream_statlist(st));
 	return true;
 }
 
-/* Command: SHOW SERVERS */
-static bool admin_show_servers(PgSocket *admin, const char *arg)
+/* fill next chunk */
+static void stream_fill(ShowStream *st)
 {
+	PktBuf *buf = st->buf;
+	PgSocket *sk;
 	List *item;
-	PgPool *pool;
-	PktBuf *buf;
+	const char *label;
 
-	buf = pktbuf_dynamic(256);
-	if (!buf) {
-		admin_error(admin, "no mem");
-		return true;
+	stream_revalidate(st);
+	while (buf->write_pos < SHOW_CHUNK_SIZE - SHOW_ROW_MAX) {
+		if (!st->pool && st->list >= 0) {
+			st->done = true;
+			break;
+		}
+		sk = st->next;
+		if (!sk) {
+			if (!stream_next_list(st)) {
+				st->done = true;
+				break;
+			}
+			continue;
+		}
+
+		label = st->list < 0 ? "cl_login" : st->lists[st->list].label;
+		if (!st->active_only || !sbuf_is_empty(&sk->sbuf))
+			socket_row(buf, sk, label, st->debug);
+
+		item = sk->head.next;
+		st->next = item == &stream_statlist(st)->head ? NULL
+			 : container_of(item, PgSocket, head);
+		st->pos++;
+	}
+	if (st->done) {
+		pktbuf_write_CommandComplete(buf, "SHOW");
+		pktbuf_write_ReadyForQuery(buf);
+	}
+}
+
+static void stream_free(ShowStream *st)
+{
+	if (st->buf->sending)
+		event_del(&st->ev);
+	statlist_remove(&st->head, &show_stream_list);
+	pktbuf_free(st->buf);
+	free(st);
+}
+
+/* send chunks until socket is full, false if stream is gone */
+static bool stream_send(ShowStream *st)
+{
+	PgSocket *admin = st->admin;
+	int fd = sbuf_socket(&admin->sbuf);
+	PktBuf *buf = st->buf;
+	int res;
+
+	while (1) {
+		if (buf->send_pos == buf->write_pos) {
+			if (st->done) {
+				stream_free(st);
+				return false;
+			}
+			buf->write_pos = buf->send_pos = 0;
+			stream_fill(st);
+			if (buf->failed) {
+				disconnect_client(admin, true, "result prepare failed");
+				return false;
+			}
+		}
+		res = safe_send(fd, buf->buf + buf->send_pos,
+				buf->write_pos - buf->send_pos, 0);
+		if (res < 0) {
+			if (errno != EAGAIN) {
+				disconnect_client(admin, false, "send failed: %s", strerror(errno));
+				return false;
+			}
+			break;
+		}
+		buf->send_pos += res;
+		if (buf->send_pos < buf->write_pos)
+			break;
 	}
 
-	socket_header(buf, false);
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		show_socket_list(buf, &pool->active_server_list, "active", false);
-		show_socket_list(buf, &pool->idle_server_list, "idle", false);
-		show_socket_list(buf, &pool->used_server_list, "used", false);
-		show_socket_list(buf, &pool->tested_server_list, "tested", false);
-		show_socket_list(buf, &pool->new_server_list, "new", false);
+	event_set(&st->ev, fd, EV_WRITE, stream_send_cb, st);
+	if (event_add(&st->ev, NULL) < 0) {
+		disconnect_client(admin, false, "event_add failed");
+		return false;
 	}
-	admin_flush(admin, buf, "SHOW");
+	buf->sending = 1;
 	return true;
 }
 
-/* Command: SHOW SOCKETS */
-static bool admin_show_sockets(PgSocket *admin, const char *arg)
+static void stream_send_cb(int fd, short flags, void *arg)
 {
-	List *item;
-	PgPool *pool;
-	PktBuf *buf;
+	ShowStream *st = arg;
+	PgSocket *admin = st->admin;
 
-	buf = pktbuf_dynamic(256);
-	if (!buf) {
+	loop_callback(LOOP_SEND);
+	st->buf->sending = 0;
+	if (stream_send(st))
+		return;
+
+	/* finished, admin can send next query */
+	if (admin->state == CL_ACTIVE)
+		sbuf_continue(&admin->sbuf);
+}
+
+static bool show_socket_lists(PgSocket *admin, const struct ShowList *lists,
+			      bool debug, bool active_only, bool login)
+{
+	ShowStream *st;
+
+	st = zmalloc(sizeof(*st));
+	if (st)
+		st->buf = pktbuf_dynamic(SHOW_CHUNK_SIZE);
+	if (!st || !st->buf) {
+		free(st);
 		admin_error(admin, "no mem");
 		return true;
 	}
+	st->admin = admin;
+	st->lists = lists;
+	st->debug = debug;
+	st->active_only = active_only;
+	st->login = login;
+	list_init(&st->head);
+	statlist_append(&st->head, &show_stream_list);
+
+	if (!statlist_empty(&pool_list)) {
+		st->pool = container_of(pool_list.head.next, PgPool, head);
+		st->next = first_socket(stream_statlist(st));
+	} else if (login) {
+		st->list = -1;
+		st->next = first_socket(&login_client_list);
+	}
 
-	socket_header(buf, true);
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		show_socket_list(buf, &pool->active_client_list, "cl_active", true);
-		show_socket_list(buf, &pool->waiting_client_list, "cl_waiting", true);
-
-		show_socket_list(buf, &pool->active_server_list, "sv_active", true);
-		show_socket_list(buf, &pool->idle_server_list, "sv_idle", true);
-		show_socket_list(buf, &pool->used_server_list, "sv_used", true);
-		show_socket_list(buf, &pool->tested_server_list, "sv_tested", true);
-		show_socket_list(buf, &pool->new_server_list, "sv_login", true);
+	/* header goes with first chunk */
+	socket_header(st->buf, debug);
+	stream_fill(st);
+	if (st->buf->failed) {
+		stream_free(st);
+		return send_pooler_error(admin, true, "result prepare failed");
 	}
-	show_socket_list(buf, &login_client_list, "cl_login", true);
-	admin_flush(admin, buf, "SHOW");
+
+	/* false also if admin was closed */
+	if (!stream_send(st))
+		return admin->state == CL_ACTIVE;
+
+	/* rest is sent later, stop reading queries meanwhile */
+	if (!sbuf_pause(&admin->sbuf))
+		disconnect_client(admin, true, "pause failed");
 	return true;
 }
 
-static void show_active_socket_list(PktBuf *buf, StatList *list, const char *state)
+/* is SHOW output still being sent to admin */
+static bool admin_streaming(PgSocket *admin)
 {
 	List *item;
-	statlist_for_each(item, list) {
-		PgSocket *sk = container_of(item, PgSocket, head);
-		if (!sbuf_is_empty(&sk->sbuf))
-			socket_row(buf, sk, state, true);
+	ShowStream *st;
+
+	statlist_for_each(item, &show_stream_list) {
+		st = container_of(item, ShowStream, head);
+		if (st->admin == admin)
+			return true;
 	}
+	return false;
 }
 
-/* Command: SHOW ACTIVE_SOCKETS */
-static bool admin_show_active_sockets(PgSocket *admin, const char *arg)
+/* admin connection is closing, drop its unfinished output */
+void admin_forget_client(PgSocket *admin)
 {
-	List *item;
-	PgPool *pool;
-	PktBuf *buf;
+	List *item, *tmp;
+	ShowStream *st;
 
-	buf = pktbuf_dynamic(256);
-	if (!buf) {
-		admin_error(admin, "no mem");
-		return true;
+	statlist_for_each_safe(item, &show_stream_list, tmp) {
+		st = container_of(item, ShowStream, head);
+		if (st->admin == admin)
+			stream_free(st);
 	}
+}
 
-	socket_header(buf, true);
-	statlist_for_each(item, &pool_list) {
-		pool = container_of(item, PgPool, head);
-		show_active_socket_list(buf, &pool->active_client_list, "cl_active");
-		show_active_socket_list(buf, &pool->waiting_client_list, "cl_waiting");
-
-		show_active_socket_list(buf, &pool->active_server_list, "sv_active");
-		show_active_socket_list(buf, &pool->idle_server_list, "sv_idle");
-		show_active_socket_list(buf, &pool->used_server_list, "sv_used");
-		show_active_socket_list(buf, &pool->tested_server_list, "sv_tested");
-		show_active_socket_list(buf, &pool->new_server_list, "sv_login");
-	}
-	show_active_socket_list(buf, &login_client_list, "cl_login");
-	admin_flush(admin, buf, "SHOW");
-	return true;
+/* Command: SHOW CLIENTS */
+static bool admin_show_clients(PgSocket *admin, const char *arg)
+{
+	return show_socket_lists(admin, client_lists, false, false, false);
+}
+
+/* Command: SHOW SERVERS */
+static bool admin_show_servers(PgSocket *admin, const char *arg)
+{
+	return show_socket_lists(admin, server_lists, false, false, false);
+}
+
+/* Command: SHOW SOCKETS */
+static bool admin_show_sockets(PgSocket *admin, const char *arg)
+{
+	return show_socket_lists(admin, socket_lists, true, false, true);
+}
+
+/* Command: SHOW ACTIVE_SOCKETS */
+static bool admin_show_active_sockets(PgSocket *admin, const char *arg)
+{
+	return show_socket_lists(admin, active_socket_lists, true, true, true);
 }
 
 /* Command: SHOW POOLS */
@@ -725,12 +1205,13 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 
 static void slab_stat_cb(void *arg, const char *slab_name,
 			 unsigned size, unsigned free,
-			 unsigned total)
+			 unsigned total, unsigned reclaimable)
 {
 	PktBuf *buf = arg;
 	unsigned alloc = total * size;
-	pktbuf_write_DataRow(buf, "siiii", slab_name,
-			     size, total - free, free, alloc);
+	pktbuf_write_DataRow(buf, "siiiii", slab_name,
+			     size, total - free, free, alloc,
+			     reclaimable * size);
 }
 
 /* Command: SHOW MEM */
@@ -743,13 +1224,44 @@ static bool admin_show_mem(PgSocket *admin, const char *arg)
 		admin_error(admin, "no mem");
 		return true;
 	}
-	pktbuf_write_RowDescription(buf, "siiii", "name",
-				    "size", "used", "free", "memtotal");
+	pktbuf_write_RowDescription(buf, "siiiii", "name",
+				    "size", "used", "free", "memtotal",
+				    "reclaimable");
 	objcache_stats(slab_stat_cb, buf);
 	admin_flush(admin, buf, "SHOW");
 	return true;
 }
 
+static void loop_stat_cb(void *arg, const char *name, const LoopStat *st)
+{
+	PktBuf *buf = arg;
+	uint64_t avg = st->count ? st->total / st->count : 0;
+	const uint64_t *b = st->buckets;
+
+	pktbuf_write_DataRow(buf, "sqqqqqqqqqqq", name,
+			     st->count, st->total, avg, st->max,
+			     b[0], b[1], b[2], b[3], b[4], b[5], b[6]);
+}
+
+/* Command: SHOW LOOP */
+static bool admin_show_loop(PgSocket *admin, const char *arg)
+{
+	PktBuf *buf;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+	pktbuf_write_RowDescription(buf, "sqqqqqqqqqqq", "name",
+				    "count", "total_time", "avg_time", "max_time",
+				    "lt_10us", "lt_100us", "lt_1ms", "lt_10ms",
+				    "lt_100ms", "lt_1s", "more");
+	loop_stats(loop_stat_cb, buf);
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
+
 /* Command: SHOW CONFIG */
 static bool admin_show_config(PgSocket *admin, const char *arg)
 {
@@ -850,10 +1362,14 @@ static bool admin_cmd_resume(PgSocket *admin, const char *arg)
 	return admin_ready(admin, "RESUME");
 }
 
-/* Command: SUSPEND */
+/* Command: SUSPEND [BUFFERS] */
 static bool admin_cmd_suspend(PgSocket *admin, const char *arg)
 {
-	if (arg && *arg)
+	bool buffers = false;
+
+	if (arg && strcasecmp(arg, "buffers") == 0)
+		buffers = true;
+	else if (arg && *arg)
 		return syntax_error(admin);
 
 	if (!admin->admin_user)
@@ -866,8 +1382,9 @@ static bool admin_cmd_suspend(PgSocket *admin, const char *arg)
 	if (count_paused_databases() > 0)
 		return admin_error(admin, "cannot suspend with paused databases");
 
-	log_info("SUSPEND command issued");
+	log_info("SUSPEND%s command issued", buffers ? " BUFFERS" : "");
 	cf_pause_mode = P_SUSPEND;
+	g_suspend_buffers = buffers;
 	admin->wait_for_response = 1;
 	suspend_pooler();
 
@@ -950,11 +1467,11 @@ static bool admin_show_help(PgSocket *admin, const char *arg)
 		"SNOTICE", "C00000", "MConsole usage",
 		"D\n\tSHOW HELP|CONFIG|DATABASES"
 		"|POOLS|CLIENTS|SERVERS|VERSION\n"
-		"\tSHOW STATS|FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM\n"
+		"\tSHOW STATS|QUERIES|FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM|LOOP\n"
 		"\tSET key = arg\n"
 		"\tRELOAD\n"
 		"\tPAUSE [<db>]\n"
-		"\tSUSPEND\n"
+		"\tSUSPEND [BUFFERS]\n"
 		"\tRESUME [<db>]\n"
 		"\tSHUTDOWN", "");
 	if (res)
@@ -983,19 +1500,27 @@ static bool admin_show_totals(PgSocket *admin, const char *arg)
 	return show_stat_totals(admin, &pool_list);
 }
 
+static bool admin_show_queries(PgSocket *admin, const char *arg)
+{
+	return admin_show_digests(admin, &pool_list);
+}
+
 
 static struct cmd_lookup show_map [] = {
 	{"clients", admin_show_clients},
 	{"config", admin_show_config},
 	{"databases", admin_show_databases},
 	{"fds", admin_show_fds},
+	{"fds_binary", admin_show_fds_binary},
 	{"help", admin_show_help},
 	{"lists", admin_show_lists},
+	{"loop", admin_show_loop},
 	{"pools", admin_show_pools},
 	{"servers", admin_show_servers},
 	{"sockets", admin_show_sockets},
 	{"active_sockets", admin_show_active_sockets},
 	{"stats", admin_show_stats},
+	{"queries", admin_show_queries},
 	{"users", admin_show_users},
 	{"version", admin_show_version},
 	{"totals", admin_show_totals},
@@ -1065,6 +1590,11 @@ bool admin_handle_client(PgSocket *admin, PktHdr *pkt)
 {
 	const char *q;
 	bool res;
+	usec_t start;
+
+	/* previous SHOW is still being sent */
+	if (admin_streaming(admin))
+		return false;
 
 	/* dont tolerate partial packets */
 	if (incomplete_pkt(pkt)) {
@@ -1080,7 +1610,9 @@ bool admin_handle_client(PgSocket *admin, PktHdr *pkt)
 			return false;
 		}
 		log_debug("got admin query: %s", q);
+		start = loop_clock();
 		res = admin_parse_query(admin, q);
+		loop_nested_done(LOOP_ADMIN, start);
 		if (res)
 			sbuf_prepare_skip(&admin->sbuf, pkt->len);
 		return res;
@@ -0,0 +1,355 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * Formatted log lines are copied into single-producer ring buffer
+ * by main thread.  Writer thread takes them out in batches and
+ * writes them with writev() to logfile and stderr, and passes them
+ * to syslog.  Main thread never waits for writer - if there is no
+ * room, the line is dropped and counted, writer logs the count later.
+ *
+ * Writer sleeps in poll() on a pipe, producer writes into the pipe
+ * only when writer has said it is going to sleep.
+ *
+ * Writer owns the logfile fd, reopen is requested via flag.
+ */
+
+#include "bouncer.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(__ATOMIC_ACQUIRE)
+
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define full_barrier()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* records are aligned to header size, so header always fits before wrap */
+struct LogRecord {
+	uint32_t size;		/* total record size, 0 means skip to ring start */
+	uint16_t line_len;	/* full line, with newline */
+	uint16_t msg_ofs;	/* message part for syslog */
+	uint16_t msg_len;
+	uint8_t dest;		/* ALOG_* */
+	uint8_t prio;		/* syslog priority */
+	uint32_t pad;
+};
+
+#define REC_ALIGN(x)	(((x) + sizeof(struct LogRecord) - 1) & ~(sizeof(struct LogRecord) - 1))
+
+/* records written out by one writev() */
+#define MAX_BATCH	64
+
+static char *ring;
+static unsigned long ring_size;
+
+/* byte counters, position is counter % ring_size */
+static unsigned long ring_head;	/* written by main thread */
+static unsigned long ring_tail;	/* written by writer */
+
+static unsigned long dropped;
+static int writer_sleeping;
+static int writer_stop;
+static int reopen_needed;
+
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t writer_thread;
+static bool writer_running;
+
+/* logfile state, used by writer */
+static char *log_path;
+static int log_fd = -1;
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void open_logfile(void)
+{
+	pthread_mutex_lock(&path_lock);
+	if (log_fd >= 0) {
+		close(log_fd);
+		log_fd = -1;
+	}
+	if (log_path && log_path[0])
+		log_fd = open(log_path, O_CREAT | O_APPEND | O_WRONLY, 0644);
+	pthread_mutex_unlock(&path_lock);
+}
+
+/* writer reports dropped lines itself */
+static void write_dropped(unsigned long count)
+{
+	char buf[128];
+	struct timeval tv;
+	struct tm tm;
+	time_t s;
+	int len;
+
+	gettimeofday(&tv, NULL);
+	s = tv.tv_sec;
+	localtime_r(&s, &tm);
+	len = snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d.%03d %u WARNING %lu log lines dropped, async log buffer full\n",
+		       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		       tm.tm_hour, tm.tm_min, tm.tm_sec,
+		       (int)(tv.tv_usec / 1000), (unsigned)getpid(), count);
+	if (log_fd >= 0 && safe_write(log_fd, buf, len) < len)
+		len = 0;
+}
+
+/* write out records between tail and head, return new tail */
+static unsigned long write_batch(unsigned long tail, unsigned long head)
+{
+	struct iovec iov[MAX_BATCH];
+	struct iovec err_iov[MAX_BATCH];
+	int n = 0, nerr = 0, count = 0;
+	struct LogRecord *rec;
+	char *line;
+
+	while (tail != head && count < MAX_BATCH) {
+		rec = (struct LogRecord *)(ring + tail % ring_size);
+		if (rec->size == 0) {
+			/* skip to ring start */
+			tail += ring_size - tail % ring_size;
+			continue;
+		}
+		line = (char *)(rec + 1);
+		if (rec->dest & ALOG_FILE) {
+			iov[n].iov_base = line;
+			iov[n].iov_len = rec->line_len;
+			n++;
+		}
+		if (rec->dest & ALOG_STDERR) {
+			err_iov[nerr].iov_base = line;
+			err_iov[nerr].iov_len = rec->line_len;
+			nerr++;
+		}
+		if (rec->dest & ALOG_SYSLOG)
+			syslog(rec->prio, "%.*s", rec->msg_len, line + rec->msg_ofs);
+		tail += rec->size;
+		count++;
+	}
+
+	if (n > 0) {
+		if (log_fd < 0)
+			open_logfile();
+		if (log_fd >= 0 && writev(log_fd, iov, n) < 0)
+			n = 0;
+	}
+	if (nerr > 0 && writev(STDERR_FILENO, err_iov, nerr) < 0)
+		nerr = 0;
+	return tail;
+}
+
+static void wait_for_data(void)
+{
+	struct pollfd pfd;
+	char buf[64];
+
+	store_release(&writer_sleeping, 1);
+	full_barrier();
+	if (load_acquire(&ring_head) == ring_tail && !load_acquire(&writer_stop)) {
+		pfd.fd = wake_pipe[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		poll(&pfd, 1, 1000);
+	}
+	store_release(&writer_sleeping, 0);
+	while (read(wake_pipe[0], buf, sizeof(buf)) > 0) ;
+}
+
+static void *writer_main(void *arg)
+{
+	unsigned long head, tail = ring_tail, count;
+
+	while (1) {
+		if (load_acquire(&reopen_needed)) {
+			store_release(&reopen_needed, 0);
+			open_logfile();
+		}
+
+		count = __atomic_exchange_n(&dropped, 0, __ATOMIC_ACQ_REL);
+		if (count > 0)
+			write_dropped(count);
+
+		head = load_acquire(&ring_head);
+		if (head == tail) {
+			if (load_acquire(&writer_stop))
+				break;
+			wait_for_data();
+			continue;
+		}
+		tail = write_batch(tail, head);
+		store_release(&ring_tail, tail);
+	}
+	return NULL;
+}
+
+static void wake_writer(void)
+{
+	full_barrier();
+	if (load_acquire(&writer_sleeping)) {
+		if (write(wake_pipe[1], "", 1) < 0) {
+			/* pipe full, writer will wake anyway */
+		}
+	}
+}
+
+/* start writer thread if configured */
+void asynclog_setup(void)
+{
+	sigset_t all, old;
+	int err;
+
+	if (cf_log_async_buffer <= 0)
+		return;
+
+	ring_size = REC_ALIGN((unsigned long)cf_log_async_buffer);
+	if (ring_size < 16*1024)
+		ring_size = 16*1024;
+	ring = malloc(ring_size);
+	if (!ring)
+		fatal("no mem for async log buffer");
+	log_path = strdup(cf_logfile);
+	if (!log_path)
+		fatal("no mem for async log");
+	log_fd = logfile_handover();
+
+	if (pipe(wake_pipe) < 0)
+		fatal_perror("pipe");
+	socket_set_nonblocking(wake_pipe[0], 1);
+	socket_set_nonblocking(wake_pipe[1], 1);
+	fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	/* signals must be handled by main thread, writer inherits the mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&writer_thread, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		fatal("cannot start log writer: %s", strerror(err));
+	writer_running = true;
+
+	/* lines logged at exit must not be lost */
+	atexit(asynclog_stop);
+	log_debug("async logging started, buffer %lu bytes", ring_size);
+}
+
+/* write out everything that is buffered and stop the writer */
+void asynclog_stop(void)
+{
+	if (!writer_running)
+		return;
+	writer_running = false;
+	store_release(&writer_stop, 1);
+	if (write(wake_pipe[1], "", 1) < 0) {
+		/* writer wakes up by timeout */
+	}
+	pthread_join(writer_thread, NULL);
+	if (log_fd >= 0) {
+		close(log_fd);
+		log_fd = -1;
+	}
+}
+
+bool asynclog_active(void)
+{
+	return writer_running;
+}
+
+/*
+ * Copy line into ring.  If there is no room, the line is dropped,
+ * writing it synchronously would mess up the order.
+ */
+void asynclog_write(const char *line, unsigned len, unsigned msg_ofs,
+		    unsigned msg_len, int dest, int prio)
+{
+	unsigned long head = ring_head;
+	unsigned long tail = load_acquire(&ring_tail);
+	unsigned long pos = head % ring_size;
+	unsigned long need = REC_ALIGN(sizeof(struct LogRecord) + len);
+	unsigned long skip = 0;
+	struct LogRecord *rec;
+
+	/* record must not cross ring end */
+	if (pos + need > ring_size)
+		skip = ring_size - pos;
+	if (ring_size - (head - tail) < need + skip) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (skip) {
+		rec = (struct LogRecord *)(ring + pos);
+		rec->size = 0;
+		head += skip;
+		pos = 0;
+	}
+
+	rec = (struct LogRecord *)(ring + pos);
+	rec->size = need;
+	rec->line_len = len;
+	rec->msg_ofs = msg_ofs;
+	rec->msg_len = msg_len;
+	rec->dest = dest;
+	rec->prio = prio;
+	memcpy(rec + 1, line, len);
+
+	store_release(&ring_head, head + need);
+	wake_writer();
+}
+
+/* logfile name may have changed */
+void asynclog_reopen(void)
+{
+	char *path = strdup(cf_logfile);
+	if (!path)
+		return;
+	pthread_mutex_lock(&path_lock);
+	free(log_path);
+	log_path = path;
+	pthread_mutex_unlock(&path_lock);
+	store_release(&reopen_needed, 1);
+	wake_writer();
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+void asynclog_setup(void)
+{
+	if (cf_log_async_buffer > 0)
+		log_warning("log_async_buffer: threads not supported, logging synchronously");
+}
+
+void asynclog_stop(void) {}
+
+bool asynclog_active(void)
+{
+	return false;
+}
+
+void asynclog_write(const char *line, unsigned len, unsigned msg_ofs,
+		    unsigned msg_len, int dest, int prio)
+{
+}
+
+void asynclog_reopen(void) {}
+
+#endif
@@ -96,6 +96,14 @@ bool set_pool(PgSocket *client, const char *dbname, const char *username)
 		disconnect_client(client, true, "no memory for pool");
 		return false;
 	}
+	USDT_PROBE4(client__pool, client->id, client->pool->id,
+		    db->name, client->pool->user->name);
+
+	/* don't add to a queue that would not be served in time */
+	if (!check_admission(client, false)) {
+		disconnect_client(client, false, "admission control");
+		return false;
+	}
 
 	return check_fast_fail(client);
 }
@@ -117,10 +125,10 @@ static bool decide_startup_pool(PgSocket *client, PktHdr *pkt)
 			dbname = val;
 		else if (strcmp(key, "user") == 0)
 			username = val;
-		else if (strcmp(key, "application_name") == 0)
-			/* ignore */ ;
 		else if (varcache_set(&client->vars, key, val))
 			slog_debug(client, "got var: %s=%s", key, val);
+		else if (strcmp(key, "application_name") == 0)
+			/* ignore */ ;
 		else if (strlist_contains(cf_ignore_startup_params, key)) {
 			slog_debug(client, "ignoring startup parameter: %s=%s", key, val);
 		} else {
@@ -282,6 +290,203 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 	return true;
 }
 
+/* does query contain call to function with that prefix? */
+static bool query_calls(const char *q, const char *func)
+{
+	unsigned len = strlen(func);
+
+	for (; *q; q++) {
+		if (strncasecmp(q, func, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Is SET about parameter that varcache restores on relink?
+ * p points after second word of query, which is in w2.
+ */
+static bool set_is_tracked(PgPool *pool, const char *p, const char *w2)
+{
+	char name[32], w[32];
+
+	safe_strcpy(name, w2, sizeof(name));
+	if (strcmp(name, "session") == 0)
+		p = sql_next_word(p, name, sizeof(name));
+	if (strcmp(name, "time") == 0) {
+		sql_next_word(p, w, sizeof(w));
+		if (strcmp(w, "zone") == 0)
+			return varcache_reported(&pool->orig_vars, "timezone");
+	}
+
+	/* name was cut short, eg. "a.b" or "a1" */
+	if (*p == '.' || isalnum((unsigned char)*p) || *p == '$')
+		return false;
+	return varcache_reported(&pool->orig_vars, name);
+}
+
+/* how does query change session state that keeps client on server */
+static uint8_t session_pin_flags(PgPool *pool, const char *q, uint8_t flags)
+{
+	char w1[32], w2[32];
+	const char *p;
+
+	p = sql_next_word(q, w1, sizeof(w1));
+	p = sql_next_word(p, w2, sizeof(w2));
+
+	if (strcmp(w1, "set") == 0) {
+		/* those last only until end of transaction */
+		if (strcmp(w2, "local") && strcmp(w2, "transaction")
+		    && strcmp(w2, "constraints") && !set_is_tracked(pool, p, w2))
+			flags |= PIN_SET;
+	} else if (strcmp(w1, "reset") == 0) {
+		if (strcmp(w2, "all") == 0)
+			flags &= ~PIN_SET;
+	} else if (strcmp(w1, "prepare") == 0) {
+		/* PREPARE TRANSACTION is not about statements */
+		if (strcmp(w2, "transaction"))
+			flags |= PIN_PREPARE;
+	} else if (strcmp(w1, "deallocate") == 0) {
+		if (strcmp(w2, "all") == 0)
+			flags &= ~PIN_PREPARE;
+	} else if (strcmp(w1, "create") == 0) {
+		if (strcmp(w2, "temp") == 0 || strcmp(w2, "temporary") == 0)
+			flags |= PIN_TEMP;
+	} else if (strcmp(w1, "listen") == 0) {
+		flags |= PIN_LISTEN;
+	} else if (strcmp(w1, "unlisten") == 0) {
+		while (*p && isspace((unsigned char)*p))
+			p++;
+		if (*p == '*')
+			flags &= ~PIN_LISTEN;
+	} else if (strcmp(w1, "discard") == 0) {
+		if (strcmp(w2, "all") == 0)
+			flags = 0;
+		else if (strcmp(w2, "temp") == 0 || strcmp(w2, "temporary") == 0)
+			flags &= ~PIN_TEMP;
+	}
+
+	/* session-level advisory locks, xact ones are fine */
+	if (query_calls(q, "pg_advisory_unlock_all"))
+		flags &= ~PIN_LOCK;
+	else if (query_calls(q, "pg_advisory_lock") || query_calls(q, "pg_try_advisory_lock"))
+		flags |= PIN_LOCK;
+
+	return flags;
+}
+
+/*
+ * Look at query going to server for session state.  Only start
+ * of long query is seen, if it does not fit into buffer.
+ */
+static void check_session_pin(PgSocket *client, PktHdr *pkt)
+{
+	char buf[1024];
+	const char *name;
+	uint8_t flags = client->pin_flags;
+	unsigned len;
+	MBuf tmp;
+
+	mbuf_copy(&pkt->data, &tmp);
+	if (pkt->type == 'P') {
+		/* named statement stays on server */
+		name = mbuf_get_string(&tmp);
+		if (!name)
+			return;
+		if (*name)
+			flags |= PIN_PREPARE;
+	}
+
+	len = mbuf_avail(&tmp);
+	if (len > sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+	memcpy(buf, mbuf_get_bytes(&tmp, len), len);
+	buf[len] = 0;
+	flags = session_pin_flags(client->pool, buf, flags);
+
+	if (flags != client->pin_flags) {
+		slog_debug(client, "session pin: %s (flags=%d)",
+			   flags ? "pinned" : "released", flags);
+		client->pin_flags = flags;
+	}
+}
+
+/*
+ * Keep start of query for log_slow_queries.  Only first packet
+ * of request is looked at, so Bind/Execute of already parsed
+ * statement has no text.
+ *
+ * Buffer is allocated on first query and reused until client
+ * goes away.  Here it is only copied, it is made printable
+ * when the query turns out to be slow.
+ */
+static void remember_query_text(PgSocket *client, PktHdr *pkt)
+{
+	const uint8_t *q;
+	unsigned len = 0;
+	MBuf tmp;
+
+	if (!client->query_text) {
+		client->query_text = malloc(SLOW_QUERY_LEN);
+		if (!client->query_text)
+			return;
+	}
+
+	mbuf_copy(&pkt->data, &tmp);
+	if (pkt->type == 'Q' || (pkt->type == 'P' && mbuf_get_string(&tmp))) {
+		len = mbuf_avail(&tmp);
+		if (len > SLOW_QUERY_LEN - 1)
+			len = SLOW_QUERY_LEN - 1;
+		q = mbuf_get_bytes(&tmp, len);
+		memcpy(client->query_text, q, len);
+	}
+	client->query_text[len] = 0;
+}
+
+/*
+ * Query took longer than log_slow_queries.  To keep slowdown
+ * from flooding the log, at most log_slow_queries_rate lines
+ * per second are written, rest are counted.
+ */
+void log_slow_query(PgSocket *client, usec_t total, usec_t wait)
+{
+	static usec_t period_start;
+	static int period_count;
+	static uint64_t skipped;
+	usec_t now = get_cached_time();
+	char q[SLOW_QUERY_LEN];
+	unsigned i = 0;
+
+	if (now - period_start >= USEC) {
+		period_start = now;
+		period_count = 0;
+	}
+	if (cf_log_slow_queries_rate > 0 && period_count >= cf_log_slow_queries_rate) {
+		skipped++;
+		return;
+	}
+	period_count++;
+
+	/* one line in log */
+	if (client->query_text) {
+		for (; client->query_text[i]; i++) {
+			unsigned char c = client->query_text[i];
+			q[i] = isspace(c) ? ' ' : c;
+		}
+	}
+	q[i] = 0;
+
+	if (skipped) {
+		log_info("%llu slow queries not logged because of log_slow_queries_rate",
+			 (unsigned long long)skipped);
+		skipped = 0;
+	}
+	slog_info(client, "slow query: %llu ms (wait %llu ms): %s",
+		  (unsigned long long)(total / 1000),
+		  (unsigned long long)(wait / 1000),
+		  *q ? q : "(no query text)");
+}
+
 /* decide on packets of logged-in client */
 static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 {
@@ -312,15 +517,40 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 	case 'D':		/* Describe */
 	case 'd':		/* CopyData(F/B) */
 
+		/*
+		 * Shed load before query is queued.  Only simple query
+		 * can be answered with error here, for extended protocol
+		 * it would need skipping until Sync.
+		 */
+		if (pkt->type == 'Q' && !client->link && !check_admission(client, true)) {
+			sbuf_prepare_skip(sbuf, pkt->len);
+			return true;
+		}
+
 		/* update stats */
 		if (!client->query_start) {
 			client->pool->stats.request_count++;
 			client->query_start = get_cached_time();
+			if (cf_log_slow_queries > 0 && !client->pool->db->admin)
+				remember_query_text(client, pkt);
 		}
 
 		if (client->pool->db->admin)
 			return admin_handle_client(client, pkt);
 
+		/* LISTEN is served from shared listener connection */
+		if (notify_query_ok(client, pkt))
+			return notify_client_query(client, pkt);
+
+		/* autocommit queries can share server with other clients */
+		if (client->muxed || (cf_pool_mode == POOL_MUX && !client->link)) {
+			if (mux_query_ok(client, pkt))
+				return mux_send_query(client, pkt);
+			/* anything else waits until queued answers are in */
+			if (client->muxed)
+				return mux_wait(client);
+		}
+
 		/* aquire server */
 		if (!find_server(client))
 			return false;
@@ -329,6 +559,23 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 
 		/* tag the server as dirty */
 		client->link->ready = 0;
+		if (!client->link->query_start) {
+			/* only first statement of request waited for server */
+			bool first = !client->link_time;
+			client->link->query_start = get_cached_time();
+			if (first)
+				client->link_time = client->link->query_start;
+			USDT_PROBE3(query__start, client->id, client->link->id,
+				    first ? client->link_time - client->query_start : 0);
+		}
+
+		/* keep server if query leaves state behind */
+		if (cf_session_pinning && cf_pool_mode != POOL_SESSION
+		    && (pkt->type == 'Q' || pkt->type == 'P'))
+			check_session_pin(client, pkt);
+
+		if (cf_query_digest_size > 0 && (pkt->type == 'Q' || pkt->type == 'P'))
+			digest_client_query(client, pkt);
 
 		/* forward the packet */
 		sbuf_prepare_send(sbuf, &client->link->sbuf, pkt->len);
@@ -0,0 +1,425 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Query digest statistics.
+ *
+ * Literals are replaced with '?' and lists of them collapsed, so
+ * same statement with different values gives same digest.  Table
+ * has room for query_digest_size entries, when it is full the
+ * entry with least calls is replaced ("space-saving" algorithm):
+ * new entry inherits the count, which is remembered as possible
+ * overcount.  So frequent queries stay in table and their
+ * call counts are exact up to 'error' column.
+ */
+
+#include "bouncer.h"
+
+typedef struct QueryDigest {
+	uint32_t hash;		/* lookup3 hash of normalized query */
+	int next;		/* next entry in hash bucket, -1 if last */
+	uint64_t calls;
+	uint64_t error;		/* calls may be overcounted by that much */
+	usec_t total_time;
+	usec_t max_time;
+	uint64_t query_bytes;	/* sent by clients */
+	uint64_t result_bytes;	/* sent by servers */
+	char query[DIGEST_QUERY_LEN];
+} QueryDigest;
+
+struct DigestTable {
+	int size;		/* max entries, query_digest_size when created */
+	int used;
+	unsigned mask;		/* bucket count - 1 */
+	int *buckets;
+	QueryDigest *entries;
+};
+
+/* part of query text that is looked at */
+#define DIGEST_SCAN_LEN 1024
+
+static bool is_ident_char(unsigned char c)
+{
+	return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+/* write placeholder, "?, ?" becomes "?" */
+static unsigned put_param(char *dst, unsigned n)
+{
+	unsigned i = n;
+
+	while (i > 0 && dst[i - 1] == ' ')
+		i--;
+	if (i > 0 && dst[i - 1] == ',') {
+		i--;
+		while (i > 0 && dst[i - 1] == ' ')
+			i--;
+		if (i > 0 && dst[i - 1] == '?')
+			return i;
+	}
+	dst[n++] = '?';
+	return n;
+}
+
+/* skip quoted literal, q points to opening quote */
+static const char *skip_quoted(const char *q, char quote)
+{
+	for (q++; *q; q++) {
+		if (*q == '\\' && q[1])
+			q++;
+		else if (*q == quote) {
+			if (q[1] != quote)
+				return q + 1;
+			q++;
+		}
+	}
+	return q;
+}
+
+/* skip $tag$ ... $tag$ string, NULL if not one */
+static const char *skip_dollar_quoted(const char *q)
+{
+	const char *p = q + 1, *end;
+	char tag[64];
+	unsigned len;
+
+	while (*p && *p != '$' && (isalnum((unsigned char)*p) || *p == '_'))
+		p++;
+	if (*p != '$')
+		return NULL;
+	len = p - q + 1;
+	if (len >= sizeof(tag))
+		return NULL;
+	memcpy(tag, q, len);
+	tag[len] = 0;
+	end = strstr(p + 1, tag);
+	return end ? end + len : p + strlen(p);
+}
+
+/*
+ * Replace literals and $n params with '?', drop comments,
+ * collapse whitespace.  Returns length of result.
+ */
+static unsigned normalize_query(const char *q, char *dst, unsigned dstlen)
+{
+	unsigned n = 0, start;
+	const char *p;
+	bool space = false;
+
+	while (*q && n < dstlen - 1) {
+		if (isspace((unsigned char)*q)) {
+			space = true;
+			q++;
+			continue;
+		}
+		if (q[0] == '-' && q[1] == '-') {
+			while (*q && *q != '\n')
+				q++;
+			space = true;
+			continue;
+		}
+		if (q[0] == '/' && q[1] == '*') {
+			p = strstr(q + 2, "*/");
+			q = p ? p + 2 : q + strlen(q);
+			space = true;
+			continue;
+		}
+		if (space && n > 0) {
+			dst[n++] = ' ';
+			if (n >= dstlen - 1)
+				break;
+		}
+		space = false;
+
+		if (*q == '\'') {
+			q = skip_quoted(q, '\'');
+			n = put_param(dst, n);
+		} else if (*q == '$' && isdigit((unsigned char)q[1])) {
+			for (q++; isdigit((unsigned char)*q); q++);
+			n = put_param(dst, n);
+		} else if (*q == '$' && (p = skip_dollar_quoted(q)) != NULL) {
+			q = p;
+			n = put_param(dst, n);
+		} else if (isdigit((unsigned char)*q) || (*q == '.' && isdigit((unsigned char)q[1]))) {
+			while (isdigit((unsigned char)*q) || *q == '.')
+				q++;
+			if ((*q == 'e' || *q == 'E')
+			    && (isdigit((unsigned char)q[1])
+				|| ((q[1] == '-' || q[1] == '+') && isdigit((unsigned char)q[2])))) {
+				for (q += 2; isdigit((unsigned char)*q); q++);
+			}
+			n = put_param(dst, n);
+		} else if (*q == '"') {
+			p = skip_quoted(q, '"');
+			while (q < p && n < dstlen - 1)
+				dst[n++] = *q++;
+			q = p;
+		} else if (is_ident_char(*q)) {
+			start = n;
+			while (is_ident_char(*q) && n < dstlen - 1)
+				dst[n++] = *q++;
+			/* E'..', B'..', X'..' prefixes go with the literal */
+			if (*q == '\'' && n - start == 1)
+				n = start;
+		} else
+			dst[n++] = *q++;
+	}
+	dst[n] = 0;
+	return n;
+}
+
+static bool digest_init(PgPool *pool)
+{
+	DigestTable *tbl;
+	unsigned nbuckets = 16;
+	unsigned i;
+
+	while (nbuckets < (unsigned)cf_query_digest_size)
+		nbuckets *= 2;
+
+	tbl = zmalloc(sizeof(*tbl));
+	if (!tbl)
+		return false;
+	tbl->size = cf_query_digest_size;
+	tbl->mask = nbuckets - 1;
+	tbl->buckets = malloc(nbuckets * sizeof(int));
+	tbl->entries = malloc(tbl->size * sizeof(QueryDigest));
+	if (!tbl->buckets || !tbl->entries) {
+		free(tbl->buckets);
+		free(tbl->entries);
+		free(tbl);
+		return false;
+	}
+	for (i = 0; i < nbuckets; i++)
+		tbl->buckets[i] = -1;
+	pool->digests = tbl;
+	return true;
+}
+
+void digest_free(PgPool *pool)
+{
+	DigestTable *tbl = pool->digests;
+
+	if (!tbl)
+		return;
+	free(tbl->buckets);
+	free(tbl->entries);
+	free(tbl);
+	pool->digests = NULL;
+}
+
+/* drop table if query_digest_size was changed by SET or reload */
+void digest_maint(PgPool *pool)
+{
+	if (pool->digests && pool->digests->size != cf_query_digest_size)
+		digest_free(pool);
+}
+
+/* identity is hash only, collisions are not worth the text compare */
+static QueryDigest *digest_lookup(DigestTable *tbl, uint32_t hash)
+{
+	QueryDigest *d;
+	int i;
+
+	for (i = tbl->buckets[hash & tbl->mask]; i >= 0; i = d->next) {
+		d = &tbl->entries[i];
+		if (d->hash == hash)
+			return d;
+	}
+	return NULL;
+}
+
+static void digest_unlink(DigestTable *tbl, int idx)
+{
+	int *pos = &tbl->buckets[tbl->entries[idx].hash & tbl->mask];
+
+	while (*pos != idx)
+		pos = &tbl->entries[*pos].next;
+	*pos = tbl->entries[idx].next;
+}
+
+/* find place for new query, evicting least called one if full */
+static QueryDigest *digest_insert(DigestTable *tbl, uint32_t hash, const char *query)
+{
+	QueryDigest *d;
+	uint64_t inherited = 0;
+	int i, idx;
+
+	if (tbl->used < tbl->size) {
+		idx = tbl->used++;
+	} else {
+		idx = 0;
+		for (i = 1; i < tbl->used; i++) {
+			if (tbl->entries[i].calls < tbl->entries[idx].calls)
+				idx = i;
+		}
+		inherited = tbl->entries[idx].calls;
+		digest_unlink(tbl, idx);
+	}
+
+	d = &tbl->entries[idx];
+	memset(d, 0, sizeof(*d));
+	d->hash = hash;
+	d->calls = inherited;
+	d->error = inherited;
+	safe_strcpy(d->query, query, sizeof(d->query));
+
+	d->next = tbl->buckets[hash & tbl->mask];
+	tbl->buckets[hash & tbl->mask] = idx;
+	return d;
+}
+
+/* count query going to server, its time is added when it is done */
+void digest_client_query(PgSocket *client, PktHdr *pkt)
+{
+	PgPool *pool = client->pool;
+	char text[DIGEST_SCAN_LEN];
+	char norm[DIGEST_QUERY_LEN];
+	QueryDigest *d;
+	uint32_t hash;
+	unsigned len;
+	MBuf tmp;
+
+	/* only first query in pipeline is tracked */
+	if (client->digest_hash)
+		return;
+
+	digest_maint(pool);
+	if (!pool->digests && !digest_init(pool))
+		return;
+
+	mbuf_copy(&pkt->data, &tmp);
+	if (pkt->type == 'P' && !mbuf_get_string(&tmp))
+		return;
+	len = mbuf_avail(&tmp);
+	if (len > sizeof(text) - 1)
+		len = sizeof(text) - 1;
+	memcpy(text, mbuf_get_bytes(&tmp, len), len);
+	text[len] = 0;
+
+	len = normalize_query(text, norm, sizeof(norm));
+	if (len == 0)
+		return;
+	hash = lookup3_hash(norm, len);
+	if (!hash)
+		hash = 1;
+
+	d = digest_lookup(pool->digests, hash);
+	if (!d)
+		d = digest_insert(pool->digests, hash, norm);
+	d->calls++;
+	d->query_bytes += pkt->len;
+
+	client->digest_hash = hash;
+	client->digest_bytes = 0;
+	client->digest_start = get_cached_time();
+}
+
+/*
+ * Query answered, on each ReadyForQuery, so statements inside
+ * transaction are counted separately.  Entry may be evicted meanwhile.
+ */
+void digest_query_done(PgSocket *client)
+{
+	DigestTable *tbl = client->pool->digests;
+	QueryDigest *d;
+	usec_t time;
+
+	if (!client->digest_hash)
+		return;
+	time = get_cached_time() - client->digest_start;
+	d = tbl ? digest_lookup(tbl, client->digest_hash) : NULL;
+	if (d) {
+		d->total_time += time;
+		if (time > d->max_time)
+			d->max_time = time;
+		d->result_bytes += client->digest_bytes;
+	}
+	client->digest_hash = 0;
+	client->digest_bytes = 0;
+}
+
+static int cmp_total_time(const void *a, const void *b)
+{
+	const QueryDigest *da = *(const QueryDigest **)a;
+	const QueryDigest *db = *(const QueryDigest **)b;
+
+	if (da->total_time != db->total_time)
+		return da->total_time > db->total_time ? -1 : 1;
+	if (da->calls != db->calls)
+		return da->calls > db->calls ? -1 : 1;
+	return 0;
+}
+
+/* SHOW QUERIES: each pool's digests, most time-consuming first */
+bool admin_show_digests(PgSocket *admin, StatList *pool_list)
+{
+	QueryDigest **list = NULL, *d;
+	DigestTable *tbl;
+	PgPool *pool;
+	List *item;
+	PktBuf *buf;
+	int i, alloc = 0;
+
+	buf = pktbuf_dynamic(1024);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "ssqqqqqqqs", "database", "user",
+				    "calls", "error", "total_time", "avg_time",
+				    "max_time", "query_bytes", "result_bytes",
+				    "query");
+	statlist_for_each(item, pool_list) {
+		pool = container_of(item, PgPool, head);
+		digest_maint(pool);
+		tbl = pool->digests;
+		if (!tbl || !tbl->used)
+			continue;
+
+		if (alloc < tbl->used) {
+			free(list);
+			list = malloc(tbl->used * sizeof(*list));
+			if (!list) {
+				pktbuf_free(buf);
+				admin_error(admin, "no mem");
+				return true;
+			}
+			alloc = tbl->used;
+		}
+		for (i = 0; i < tbl->used; i++)
+			list[i] = &tbl->entries[i];
+		qsort(list, tbl->used, sizeof(*list), cmp_total_time);
+
+		for (i = 0; i < tbl->used; i++) {
+			d = list[i];
+			pktbuf_write_DataRow(buf, "ssqqqqqqqs",
+					     pool->db->name, pool->user->name,
+					     d->calls, d->error,
+					     (uint64_t)d->total_time,
+					     (uint64_t)(d->calls > d->error ? d->total_time / (d->calls - d->error) : 0),
+					     (uint64_t)d->max_time,
+					     d->query_bytes, d->result_bytes,
+					     d->query);
+		}
+	}
+	free(list);
+	admin_flush(admin, buf, "SHOW");
+	return true;
+}
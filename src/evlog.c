@@ -0,0 +1,288 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Binary event log.
+ *
+ * Connection lifecycle events are stored as fixed-size records into
+ * ring in mmap'ed file, without any formatting.  Texts like close
+ * reason templates and pool names are stored once into text table in
+ * file header, records refer to them by index.  When the table is full
+ * and the ring has wrapped since it was started, it is started again
+ * and pool names are logged anew.  Records before text_epoch then have
+ * no texts.  test/evlogdump.py decodes
+ * the file.
+ *
+ * If existing file has same layout, it is continued, so history
+ * survives restarts.  Each process starts with EVLOG_START record and
+ * records for pools and sockets it already has, eg. from takeover.
+ */
+
+#include "bouncer.h"
+
+#define EVLOG_MAGIC	"PGBEVLOG"
+#define EVLOG_VERSION	2
+
+/* text table entries */
+#define EVLOG_TEXT_MAX	1024
+
+/* index for texts that did not fit into table */
+#define EVLOG_TEXT_OTHER	0xFFFF
+
+struct EvLogHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;	/* offset of records */
+	uint32_t record_size;
+	uint32_t capacity;	/* records in ring */
+	uint32_t text_max;
+	uint32_t text_count;	/* used entries in text table, 0 is unused */
+	uint64_t write_count;	/* records written, ever */
+	uint64_t start_time;	/* when file was created */
+	uint64_t text_epoch;	/* write_count when text table was started */
+	uint8_t pad[8];
+};
+
+#define EVLOG_HEADER_SIZE \
+	((sizeof(struct EvLogHeader) + EVLOG_TEXT_MAX * EVLOG_TEXT_LEN + 4095) & ~4095)
+
+bool evlog_active = false;
+
+static struct EvLogHeader *evlog_hdr;
+static char *evlog_texts;
+static struct EvLogRecord *evlog_records;
+
+/* text -> index, open addressing */
+#define TEXT_HASH_SIZE	(EVLOG_TEXT_MAX * 2)
+static uint16_t text_hash[TEXT_HASH_SIZE];
+
+/* logging pool names after text table reset */
+static bool relog_pools;
+
+static inline char *text_entry(unsigned idx)
+{
+	return evlog_texts + idx * EVLOG_TEXT_LEN;
+}
+
+/* find index for text, add it to table if new */
+static unsigned text_index(const char *text)
+{
+	unsigned len = strlen(text);
+	unsigned h, idx;
+	char *dst;
+
+	if (len >= EVLOG_TEXT_LEN)
+		len = EVLOG_TEXT_LEN - 1;
+
+	h = lookup3_hash(text, len) % TEXT_HASH_SIZE;
+	while (text_hash[h]) {
+		idx = text_hash[h];
+		dst = text_entry(idx);
+		if (strncmp(dst, text, len) == 0 && dst[len] == 0)
+			return idx;
+		h = (h + 1) % TEXT_HASH_SIZE;
+	}
+
+	if (evlog_hdr->text_count >= EVLOG_TEXT_MAX)
+		return EVLOG_TEXT_OTHER;
+
+	idx = evlog_hdr->text_count++;
+	dst = text_entry(idx);
+	memcpy(dst, text, len);
+	dst[len] = 0;
+	text_hash[h] = idx;
+	return idx;
+}
+
+/* start text table again, texts of earlier records are lost */
+static void reset_texts(void)
+{
+	List *item;
+
+	memset(text_hash, 0, sizeof(text_hash));
+	evlog_hdr->text_count = 1;
+	evlog_hdr->text_epoch = evlog_hdr->write_count;
+	log_info("event log text table full, started again");
+
+	/* records refer to pools by id, keep names decodable */
+	relog_pools = true;
+	statlist_for_each(item, &pool_list)
+		evlog_pool_create(container_of(item, PgPool, head));
+	relog_pools = false;
+}
+
+/* load text table of continued file into hash */
+static void load_texts(void)
+{
+	unsigned i, h, len;
+	char *txt;
+
+	for (i = 1; i < evlog_hdr->text_count; i++) {
+		txt = text_entry(i);
+		len = strlen(txt);
+		h = lookup3_hash(txt, len) % TEXT_HASH_SIZE;
+		while (text_hash[h])
+			h = (h + 1) % TEXT_HASH_SIZE;
+		text_hash[h] = i;
+	}
+}
+
+/* is existing file usable as-is */
+static bool header_ok(const struct EvLogHeader *hdr, unsigned capacity)
+{
+	return memcmp(hdr->magic, EVLOG_MAGIC, 8) == 0
+		&& hdr->version == EVLOG_VERSION
+		&& hdr->header_size == EVLOG_HEADER_SIZE
+		&& hdr->record_size == sizeof(struct EvLogRecord)
+		&& hdr->capacity == capacity
+		&& hdr->text_max == EVLOG_TEXT_MAX
+		&& hdr->text_count > 0
+		&& hdr->text_count <= EVLOG_TEXT_MAX;
+}
+
+void evlog_pool_create(PgPool *pool)
+{
+	char name[MAX_DBNAME + MAX_USERNAME + 1];
+
+	snprintf(name, sizeof(name), "%s/%s", pool->db->name, pool->user->name);
+	evlog_write(EVLOG_POOL_CREATE, NULL, pool, 0, name);
+}
+
+static void log_server(PgSocket *server)
+{
+	evlog_write(EVLOG_SERVER_CONNECT, server, server->pool, EVLOG_CONN_TAKEOVER, NULL);
+}
+
+/* record objects that were created before log was opened */
+static void log_existing(void)
+{
+	List *item, *citem;
+	PgPool *pool;
+	PgSocket *client;
+
+	evlog_write(EVLOG_START, NULL, NULL, getpid(), NULL);
+
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		evlog_pool_create(pool);
+
+		for_each_server(pool, log_server);
+		statlist_for_each(citem, &pool->active_client_list) {
+			client = container_of(citem, PgSocket, head);
+			evlog_write(EVLOG_CLIENT_ACCEPT, client, pool, 1, NULL);
+		}
+	}
+}
+
+void evlog_setup(void)
+{
+#ifdef HAVE_SYS_MMAN_H
+	unsigned capacity;
+	size_t size;
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (!cf_event_log_file || !*cf_event_log_file)
+		return;
+
+	capacity = cf_event_log_size / sizeof(struct EvLogRecord);
+	if (capacity < 1024)
+		capacity = 1024;
+	size = EVLOG_HEADER_SIZE + (size_t)capacity * sizeof(struct EvLogRecord);
+
+	fd = open(cf_event_log_file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		log_error("event_log_file: %s: %s", cf_event_log_file, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st) < 0 || (st.st_size != (off_t)size && ftruncate(fd, size) < 0)) {
+		log_error("event_log_file: %s: %s", cf_event_log_file, strerror(errno));
+		close(fd);
+		return;
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_error("event_log_file: mmap: %s", strerror(errno));
+		return;
+	}
+
+	evlog_hdr = p;
+	evlog_texts = (char *)p + sizeof(struct EvLogHeader);
+	evlog_records = (struct EvLogRecord *)((char *)p + EVLOG_HEADER_SIZE);
+
+	if (header_ok(evlog_hdr, capacity)) {
+		load_texts();
+		log_info("event log %s continued at record %llu", cf_event_log_file,
+			 (unsigned long long)evlog_hdr->write_count);
+	} else {
+		memset(p, 0, EVLOG_HEADER_SIZE);
+		memcpy(evlog_hdr->magic, EVLOG_MAGIC, 8);
+		evlog_hdr->version = EVLOG_VERSION;
+		evlog_hdr->header_size = EVLOG_HEADER_SIZE;
+		evlog_hdr->record_size = sizeof(struct EvLogRecord);
+		evlog_hdr->capacity = capacity;
+		evlog_hdr->text_max = EVLOG_TEXT_MAX;
+		evlog_hdr->text_count = 1;
+		evlog_hdr->start_time = get_cached_time();
+		log_info("event log %s created, %u records", cf_event_log_file, capacity);
+	}
+	evlog_active = true;
+	log_existing();
+#else
+	if (cf_event_log_file && *cf_event_log_file)
+		log_warning("event_log_file: mmap not supported");
+#endif
+}
+
+void evlog_write(int type, const PgSocket *sk, PgPool *pool, uint32_t extra, const char *text)
+{
+	struct EvLogHeader *hdr = evlog_hdr;
+	struct EvLogRecord *rec;
+	unsigned idx = 0;
+
+	/* may write pool records, so before taking slot */
+	if (text) {
+		idx = text_index(text);
+		if (idx == EVLOG_TEXT_OTHER && !relog_pools
+		    && hdr->write_count - hdr->text_epoch >= hdr->capacity) {
+			reset_texts();
+			idx = text_index(text);
+		}
+	}
+
+	rec = &evlog_records[hdr->write_count % hdr->capacity];
+	rec->time = get_cached_time();
+	rec->type = type;
+	rec->pad = 0;
+	rec->pad2 = 0;
+	rec->extra = extra;
+	rec->text = idx;
+	if (sk) {
+		rec->sock_id = sk->id;
+		rec->addr = sk->remote_addr.is_unix ? 0 : sk->remote_addr.ip_addr.s_addr;
+		rec->port = sk->remote_addr.port;
+	} else {
+		rec->sock_id = 0;
+		rec->addr = 0;
+		rec->port = 0;
+	}
+	rec->pool_id = pool ? pool->id : 0;
+	hdr->write_count++;
+}
@@ -49,18 +49,44 @@ static void close_client_list(StatList *sk_list, const char *reason)
 	}
 }
 
+/* can socket be handed over in its current state? */
+static bool can_suspend(PgSocket *sk)
+{
+	/* spooled data, multiplexed queries and LISTENs cannot be taken over */
+	if (sbuf_has_spool(&sk->sbuf) || sk->muxed || sk->mux_queue || sk->notify)
+		return false;
+	if (sbuf_is_empty(&sk->sbuf))
+		return true;
+
+	/* SUSPEND BUFFERS: buffered data goes along, if it is simple enough */
+	if (!g_suspend_buffers)
+		return false;
+	if (sk->state != CL_ACTIVE && sk->state != SV_ACTIVE)
+		return false;
+	if (sk->setting_vars || sk->resetting || sk->exec_on_connect)
+		return false;
+	return sbuf_can_transfer(&sk->sbuf, sk->link ? &sk->link->sbuf : NULL);
+}
+
 bool suspend_socket(PgSocket *sk, bool force_suspend)
 {
-	if (sk->suspended)
+	/* linked socket may have spooled data into it after suspend */
+	if (sk->suspended && !sbuf_has_spool(&sk->sbuf))
 		return true;
 
-	if (sbuf_is_empty(&sk->sbuf)) {
-		if (sbuf_pause(&sk->sbuf))
-			sk->suspended = 1;
+	/* pending reset would be lost on takeover */
+	if (is_server_socket(sk) && sk->reset_pending) {
+		disconnect_server(sk, true, "reset pending on suspend");
+		return true;
 	}
 
-	if (sk->suspended || !force_suspend)
-		return sk->suspended;
+	if (!sk->suspended && can_suspend(sk) && sbuf_freeze(&sk->sbuf)) {
+		sk->suspended = 1;
+		return true;
+	}
+
+	if (!force_suspend)
+		return false;
 
 	if (is_server_socket(sk))
 		disconnect_server(sk, true, "suspend_timeout");
@@ -119,6 +145,7 @@ static void resume_sockets(void)
 /* resume pools and listen sockets */
 void resume_all(void)
 {
+	g_suspend_buffers = false;
 	resume_sockets();
 	resume_pooler();
 }
@@ -144,7 +171,22 @@ static void launch_recheck(PgPool *pool)
 	}
 
 	/* is the check needed? */
-	if (q == NULL || q[0] == 0)
+	if (cf_server_check_mode == CHECK_SOCKET) {
+		usec_t idle = get_cached_time() - server->request_time;
+		const char *reason;
+
+		if (cf_server_check_delay > 0 && idle < cf_server_check_delay) {
+			need_check = false;
+		} else if (!check_socket_alive(sbuf_socket(&server->sbuf),
+					       server->remote_addr.is_unix, &reason)) {
+			disconnect_server(server, true, "socket check failed: %s", reason);
+			return;
+		} else {
+			/* run query only on long-idle servers */
+			need_check = q && q[0] && cf_server_check_query_delay > 0
+				&& idle >= cf_server_check_query_delay;
+		}
+	} else if (q == NULL || q[0] == 0)
 		need_check = false;
 	else if (cf_server_check_delay > 0) {
 		usec_t now = get_cached_time();
@@ -260,6 +302,9 @@ void per_loop_maint(void)
 	int partial_pause = 0;
 	bool force_suspend = false;
 
+	/* notifications that waited for busy clients */
+	notify_flush_pending();
+
 	if (cf_pause_mode == P_SUSPEND && cf_suspend_timeout > 0) {
 		usec_t stime = get_cached_time() - g_suspend_start;
 		if (stime >= cf_suspend_timeout)
@@ -393,7 +438,7 @@ static void check_unused_servers(PgPool *pool, StatList *slist, bool idle_test)
 			}
 		} else if (cf_pause_mode == P_PAUSE) {
 			disconnect_server(server, true, "pause mode");
-		} else if (idle_test && *cf_server_check_query) {
+		} else if (idle_test && (*cf_server_check_query || cf_server_check_mode == CHECK_SOCKET)) {
 			if (idle > cf_server_check_delay)
 				change_server_state(server, SV_USED);
 		}
@@ -411,14 +456,8 @@ static void check_pool_size(PgPool *pool)
 		+ statlist_count(&pool->idle_server_list)
 		+ statlist_count(&pool->used_server_list)
 		+ statlist_count(&pool->tested_server_list);
-		
-		/* cancel pkt may create new srv conn without
-		 * taking pool_size into account
-		 *
-		 * statlist_count(&pool->new_server_list)
-		 */
 
-	int many = cur - (pool->db->pool_size + pool->db->res_pool_size);
+	int many = cur - (pool_target_size(pool) + pool->db->res_pool_size);
 
 	Assert(pool->db->pool_size >= 0);
 
@@ -433,6 +472,66 @@ static void check_pool_size(PgPool *pool)
 	}
 }
 
+/*
+ * Adaptive pool size, AIMD-style like TCP congestion control.
+ *
+ * Target grows by one while clients wait longer than adaptive_pool_max_wait,
+ * is halved when the server looks congested (connect failures or query time
+ * doubled compared to normal) and shrinks by one when servers are unused.
+ */
+static void adapt_pool_size(PgPool *pool)
+{
+	usec_t now = get_cached_time();
+	usec_t wait = 0, avg_query = 0;
+	PgSocket *waiter;
+	int target, old, min = cf_adaptive_pool_min;
+
+	if (min <= 0 || min >= pool->db->pool_size || pool->db->admin)
+		return;
+	if (now - pool->adapt_time < USEC)
+		return;
+
+	/* recent average query time in server */
+	if (pool->adapt_query_count > 0)
+		avg_query = pool->adapt_query_time / pool->adapt_query_count;
+
+	waiter = first_socket(&pool->waiting_client_list);
+	if (waiter && waiter->query_start)
+		wait = now - waiter->query_start;
+
+	target = old = pool_target_size(pool);
+
+	if (pool->adapt_connect_failed
+	    || (pool->adapt_base_query > 0 && avg_query > 2 * pool->adapt_base_query)) {
+		/* more connections will not help */
+		target = target / 2;
+	} else if (wait > (usec_t)cf_adaptive_pool_max_wait * USEC / 1000) {
+		target++;
+	} else if (!waiter && target > statlist_count(&pool->active_server_list) + 1) {
+		target--;
+	}
+
+	/* follow normal query time slowly */
+	if (avg_query > 0) {
+		if (pool->adapt_base_query)
+			pool->adapt_base_query = (pool->adapt_base_query * 7 + avg_query) / 8;
+		else
+			pool->adapt_base_query = avg_query;
+	}
+
+	pool->target_size = target;
+	target = pool_target_size(pool);
+	if (target != old)
+		log_debug("%s: pool target %d -> %d (wait=%llu avg_query=%llu)",
+			  pool->db->name, old, target,
+			  (unsigned long long)wait, (unsigned long long)avg_query);
+
+	pool->adapt_time = now;
+	pool->adapt_query_time = 0;
+	pool->adapt_query_count = 0;
+	pool->adapt_connect_failed = 0;
+}
+
 /* maintain servers in a pool */
 static void pool_server_maint(PgPool *pool)
 {
@@ -450,14 +549,39 @@ static void pool_server_maint(PgPool *pool)
 		statlist_for_each_safe(item, &pool->active_server_list, tmp) {
 			server = container_of(item, PgSocket, head);
 			Assert(server->state == SV_ACTIVE);
-			if (server->ready)
+			/* multiplexed server may have lost its client */
+			if (server->ready || !server->link)
 				continue;
 			age = now - server->link->request_time;
-			if (age > cf_query_timeout)
+			if (age <= cf_query_timeout)
+				continue;
+			if (!cf_query_timeout_grace) {
 				disconnect_server(server, true, "query timeout");
+			} else if (!server->timeout_cancel) {
+				/* try to keep the connection */
+				slog_info(server, "query timeout, sending cancel");
+				server->timeout_cancel = 1;
+				if (!cancel_server_query(server))
+					disconnect_server(server, true, "query timeout");
+			} else if (age > cf_query_timeout + cf_query_timeout_grace) {
+				disconnect_server(server, true, "query timeout, cancel did not help");
+			}
 		}
 	}
 
+	/* retry cancel requests that could not be sent yet */
+	if (!statlist_empty(&pool->cancel_req_list))
+		launch_cancel_connection(pool);
+
+	/* listener lost or stuck in login */
+	server = first_socket(&pool->listen_server_list);
+	if (server && !server->ready && cf_server_connect_timeout > 0) {
+		age = now - server->connect_time;
+		if (age > cf_server_connect_timeout)
+			disconnect_server(server, true, "connect timeout");
+	} else if (!server && notify_pool_listens(pool))
+		launch_listen_connection(pool);
+
 	/* find connections that got connect, but could not log in */
 	if (cf_server_connect_timeout > 0) {
 		statlist_for_each_safe(item, &pool->new_server_list, tmp) {
@@ -470,6 +594,7 @@ static void pool_server_maint(PgPool *pool)
 		}
 	}
 
+	adapt_pool_size(pool);
 	check_pool_size(pool);
 }
 
@@ -517,6 +642,10 @@ static void do_full_maint(int sock, short flags, void *arg)
 {
 	List *item, *tmp;
 	PgPool *pool;
+	usec_t start;
+
+	loop_callback(LOOP_TIMER);
+	start = loop_clock();
 
 	/*
 	 * Avoid doing anything that may surprise other pgbouncer.
@@ -530,6 +659,7 @@ static void do_full_maint(int sock, short flags, void *arg)
 			continue;
 		pool_server_maint(pool);
 		pool_client_maint(pool);
+		digest_maint(pool);
 		if (pool->db->db_auto && pool->db->inactive_time == 0 &&
 				pool_client_count(pool) == 0 && pool_server_count(pool) == 0 ) {
 			pool->db->inactive_time = get_cached_time();
@@ -542,6 +672,9 @@ static void do_full_maint(int sock, short flags, void *arg)
 
 	cleanup_client_logins();
 
+	if (cf_mem_reclaim_timeout > 0)
+		objcache_reclaim(cf_mem_reclaim_timeout);
+
 	if (cf_shutdown == 1 && get_active_server_count() == 0) {
 		log_info("server connections dropped, exiting");
 		cf_shutdown = 2;
@@ -552,6 +685,8 @@ static void do_full_maint(int sock, short flags, void *arg)
 	if (cf_auth_type >= AUTH_TRUST)
 		loader_users_check();
 
+	loop_nested_done(LOOP_FULL_MAINT, start);
+
 skip_maint:
 	safe_evtimer_add(&full_maint_ev, &full_maint_period);
 }
@@ -577,9 +712,13 @@ static void kill_pool(PgPool *pool)
 	close_server_list(&pool->used_server_list, reason);
 	close_server_list(&pool->tested_server_list, reason);
 	close_server_list(&pool->new_server_list, reason);
+	close_server_list(&pool->cancel_server_list, reason);
+	close_server_list(&pool->listen_server_list, reason);
 
 	list_del(&pool->map_head);
 	statlist_remove(&pool->head, &pool_list);
+	varcache_clean(&pool->orig_vars);
+	digest_free(pool);
 	obj_free(pool_cache, pool);
 }
 
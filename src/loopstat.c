@@ -0,0 +1,139 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Event loop timing.
+ *
+ * Each callback notes the time when it starts, so time since previous
+ * mark belongs to previous callback, or to waiting if it is the first
+ * one in iteration.  That is one clock read per callback.  Admin
+ * commands and full maintenance run inside callbacks and are timed
+ * separately, so they are included in recv and timer times too.
+ */
+
+#include "bouncer.h"
+
+static const char *const phase_names[LOOP_PHASE_COUNT] = {
+	[LOOP_RECV] = "recv",
+	[LOOP_SEND] = "send",
+	[LOOP_CONNECT] = "connect",
+	[LOOP_ACCEPT] = "accept",
+	[LOOP_TIMER] = "timer",
+	[LOOP_SIGNAL] = "signal",
+	[LOOP_ADMIN] = "admin",
+	[LOOP_FULL_MAINT] = "full_maint",
+	[LOOP_WAIT] = "wait",
+	[LOOP_PER_LOOP_MAINT] = "per_loop_maint",
+	[LOOP_REUSE_OBJECTS] = "reuse_objects",
+	[LOOP_POOLER_MAINT] = "pooler_maint",
+	[LOOP_BUSY] = "busy",
+};
+
+static LoopStat stat_list[LOOP_PHASE_COUNT];
+
+/* time of last mark, 0 outside of main loop */
+static usec_t last_mark;
+/* what runs since last mark */
+static enum LoopPhase cur_phase = LOOP_WAIT;
+/* end of waiting in current iteration */
+static usec_t wait_end;
+
+usec_t loop_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (usec_t)ts.tv_sec * USEC + ts.tv_nsec / 1000;
+#endif
+	return get_cached_time();
+}
+
+static void add_time(enum LoopPhase phase, usec_t start, usec_t end)
+{
+	LoopStat *st = &stat_list[phase];
+	usec_t t = end > start ? end - start : 0;
+	usec_t limit = 10;
+	int b = 0;
+
+	while (t >= limit && b < LOOP_BUCKETS - 1) {
+		limit *= 10;
+		b++;
+	}
+	st->buckets[b]++;
+	st->count++;
+	st->total += t;
+	if (t > st->max)
+		st->max = t;
+}
+
+/* move mark to now, time since previous one goes to phase */
+static usec_t add_mark(enum LoopPhase phase)
+{
+	usec_t now = loop_clock();
+	if (last_mark)
+		add_time(phase, last_mark, now);
+	last_mark = now;
+	return now;
+}
+
+void loop_iter_start(void)
+{
+	last_mark = loop_clock();
+	cur_phase = LOOP_WAIT;
+	wait_end = 0;
+}
+
+void loop_callback(enum LoopPhase phase)
+{
+	usec_t now = add_mark(cur_phase);
+	if (cur_phase == LOOP_WAIT)
+		wait_end = now;
+	cur_phase = phase;
+}
+
+void loop_events_done(void)
+{
+	usec_t now = add_mark(cur_phase);
+	if (cur_phase == LOOP_WAIT)
+		wait_end = now;
+	cur_phase = LOOP_WAIT;
+}
+
+void loop_phase_done(enum LoopPhase phase)
+{
+	add_mark(phase);
+}
+
+void loop_iter_done(void)
+{
+	add_time(LOOP_BUSY, wait_end, last_mark);
+	last_mark = 0;
+}
+
+void loop_nested_done(enum LoopPhase phase, usec_t start)
+{
+	add_time(phase, start, loop_clock());
+}
+
+void loop_stats(loop_stat_cb_t cb, void *arg)
+{
+	int i;
+
+	for (i = 0; i < LOOP_PHASE_COUNT; i++)
+		cb(arg, phase_names[i], &stat_list[i]);
+}
@@ -29,6 +29,8 @@ static bool set_mode(ConfElem *elem, const char *val, PgSocket *console);
 static const char *get_mode(ConfElem *elem);
 static bool set_auth(ConfElem *elem, const char *val, PgSocket *console);
 static const char *get_auth(ConfElem *elem);
+static bool set_check_mode(ConfElem *elem, const char *val, PgSocket *console);
+static const char *get_check_mode(ConfElem *elem);
 static bool set_defer_accept(ConfElem *elem, const char *val, PgSocket *console);
 
 static const char usage_str[] =
@@ -76,6 +78,7 @@ int cf_pool_mode = POOL_SESSION;
 /* sbuf config */
 int cf_sbuf_len = 2048;
 int cf_sbuf_loopcnt = 5;
+int cf_huge_pages = 0;
 int cf_tcp_socket_buffer = 0;
 #if defined(TCP_DEFER_ACCEPT) || defined(SO_ACCEPTFILTER)
 int cf_tcp_defer_accept = 1;
@@ -87,6 +90,10 @@ int cf_tcp_keepcnt = 0;
 int cf_tcp_keepidle = 0;
 int cf_tcp_keepintvl = 0;
 
+int cf_client_spool_size = 0;
+int cf_client_spool_file_size = 0;
+char *cf_client_spool_dir = "/tmp";
+
 int cf_auth_type = AUTH_MD5;
 char *cf_auth_file = "unconfigured_file";
 
@@ -96,27 +103,41 @@ int cf_res_pool_size = 0;
 usec_t cf_res_pool_timeout = 5;
 
 char *cf_server_reset_query = "";
+int cf_server_reset_pipeline = 0;
+int cf_session_pinning = 0;
+int cf_listen_fanout = 0;
 char *cf_server_check_query = "select 1";
 usec_t cf_server_check_delay = 30 * USEC;
+int cf_server_check_mode = CHECK_QUERY;
+usec_t cf_server_check_query_delay = 300 * USEC;
 int cf_server_round_robin = 0;
+int cf_max_cancel_conn = 5;
+int cf_adaptive_pool_min = 0;
+int cf_adaptive_pool_max_wait = 100;
+int cf_admission_max_wait = 0;
+int cf_mux_depth = 16;
 
 char *cf_ignore_startup_params = "";
+char *cf_track_extra_params = "";
 
 char *cf_autodb_connstr = NULL; /* here is "" different from NULL */
 
 usec_t cf_autodb_idle_timeout = 3600*USEC;
+usec_t cf_mem_reclaim_timeout = 60*USEC;
 
 usec_t cf_server_lifetime = 60*60*USEC;
 usec_t cf_server_idle_timeout = 10*60*USEC;
 usec_t cf_server_connect_timeout = 15*USEC;
 usec_t cf_server_login_retry = 15*USEC;
 usec_t cf_query_timeout = 0*USEC;
+usec_t cf_query_timeout_grace = 0*USEC;
 usec_t cf_query_wait_timeout = 0*USEC;
 usec_t cf_client_idle_timeout = 0*USEC;
 usec_t cf_client_login_timeout = 60*USEC;
 usec_t cf_suspend_timeout = 10*USEC;
 
 usec_t g_suspend_start = 0;
+bool g_suspend_buffers = false;
 
 char *cf_logfile = "";
 char *cf_pidfile = "";
@@ -125,10 +146,16 @@ char *cf_jobname = "pgbouncer";
 char *cf_admin_users = "";
 char *cf_stats_users = "";
 int cf_stats_period = 60;
+int cf_query_digest_size = 0;
 
 int cf_log_connections = 1;
 int cf_log_disconnections = 1;
 int cf_log_pooler_errors = 1;
+int cf_log_slow_queries = 0;
+int cf_log_slow_queries_rate = 10;
+int cf_log_async_buffer = 0;
+char *cf_event_log_file = "";
+int cf_event_log_size = 8*1024*1024;
 
 /*
  * config file description
@@ -161,11 +188,18 @@ ConfElem bouncer_params[] = {
 #endif
 
 {"autodb_idle_timeout",	true, CF_TIME, &cf_autodb_idle_timeout},
+{"mem_reclaim_timeout",	true, CF_TIME, &cf_mem_reclaim_timeout},
 
 {"server_reset_query",	true, CF_STR, &cf_server_reset_query},
+{"server_reset_pipeline",true, CF_INT, &cf_server_reset_pipeline},
+{"session_pinning",	true, CF_INT, &cf_session_pinning},
+{"listen_fanout",	true, CF_INT, &cf_listen_fanout},
 {"server_check_query",	true, CF_STR, &cf_server_check_query},
 {"server_check_delay",	true, CF_TIME, &cf_server_check_delay},
+{"server_check_mode",	true, {get_check_mode, set_check_mode}},
+{"server_check_query_delay", true, CF_TIME, &cf_server_check_query_delay},
 {"query_timeout",	true, CF_TIME, &cf_query_timeout},
+{"query_timeout_grace",	true, CF_TIME, &cf_query_timeout_grace},
 {"query_wait_timeout",	true, CF_TIME, &cf_query_wait_timeout},
 {"client_idle_timeout",	true, CF_TIME, &cf_client_idle_timeout},
 {"client_login_timeout",true, CF_TIME, &cf_client_login_timeout},
@@ -174,10 +208,17 @@ ConfElem bouncer_params[] = {
 {"server_connect_timeout",true, CF_TIME, &cf_server_connect_timeout},
 {"server_login_retry",	true, CF_TIME, &cf_server_login_retry},
 {"server_round_robin",	true, CF_INT, &cf_server_round_robin},
+{"max_cancel_connections", true, CF_INT, &cf_max_cancel_conn},
+{"adaptive_pool_min",	true, CF_INT, &cf_adaptive_pool_min},
+{"adaptive_pool_max_wait", true, CF_INT, &cf_adaptive_pool_max_wait},
+{"admission_max_wait",	true, CF_INT, &cf_admission_max_wait},
+{"multiplex_depth",	true, CF_INT, &cf_mux_depth},
 {"suspend_timeout",	true, CF_TIME, &cf_suspend_timeout},
 {"ignore_startup_parameters", true, CF_STR, &cf_ignore_startup_params},
+{"track_extra_parameters", false, CF_STR, &cf_track_extra_params},
 
 {"pkt_buf",		false, CF_INT, &cf_sbuf_len},
+{"huge_pages",		false, CF_INT, &cf_huge_pages},
 {"sbuf_loopcnt",	true, CF_INT, &cf_sbuf_loopcnt},
 {"tcp_defer_accept",	true, {cf_get_int, set_defer_accept}, &cf_tcp_defer_accept},
 {"tcp_socket_buffer",	true, CF_INT, &cf_tcp_socket_buffer},
@@ -185,13 +226,22 @@ ConfElem bouncer_params[] = {
 {"tcp_keepcnt",		true, CF_INT, &cf_tcp_keepcnt},
 {"tcp_keepidle",	true, CF_INT, &cf_tcp_keepidle},
 {"tcp_keepintvl",	true, CF_INT, &cf_tcp_keepintvl},
+{"client_spool_size",	true, CF_INT, &cf_client_spool_size},
+{"client_spool_file_size", true, CF_INT, &cf_client_spool_file_size},
+{"client_spool_dir",	true, CF_STR, &cf_client_spool_dir},
 {"verbose",		true, CF_INT, &cf_verbose},
 {"admin_users",		true, CF_STR, &cf_admin_users},
 {"stats_users",		true, CF_STR, &cf_stats_users},
 {"stats_period",	true, CF_INT, &cf_stats_period},
+{"query_digest_size",	true, CF_INT, &cf_query_digest_size},
 {"log_connections",	true, CF_INT, &cf_log_connections},
 {"log_disconnections",	true, CF_INT, &cf_log_disconnections},
 {"log_pooler_errors",	true, CF_INT, &cf_log_pooler_errors},
+{"log_slow_queries",	true, CF_INT, &cf_log_slow_queries},
+{"log_slow_queries_rate", true, CF_INT, &cf_log_slow_queries_rate},
+{"log_async_buffer",	false, CF_INT, &cf_log_async_buffer},
+{"event_log_file",	false, CF_STR, &cf_event_log_file},
+{"event_log_size",	false, CF_INT, &cf_event_log_size},
 {NULL},
 };
 
@@ -204,6 +254,7 @@ static ConfSection bouncer_config [] = {
 static const char *get_mode(ConfElem *elem)
 {
 	switch (cf_pool_mode) {
+	case POOL_MUX: return "multiplex";
 	case POOL_STMT: return "statement";
 	case POOL_TX: return "transaction";
 	case POOL_SESSION: return "session";
@@ -221,6 +272,8 @@ static bool set_mode(ConfElem *elem, const char *val, PgSocket *console)
 		cf_pool_mode = POOL_TX;
 	else if (strcasecmp(val, "statement") == 0)
 		cf_pool_mode = POOL_STMT;
+	else if (strcasecmp(val, "multiplex") == 0)
+		cf_pool_mode = POOL_MUX;
 	else {
 		admin_error(console, "bad mode: %s", val);
 		return false;
@@ -228,6 +281,30 @@ static bool set_mode(ConfElem *elem, const char *val, PgSocket *console)
 	return true;
 }
 
+static const char *get_check_mode(ConfElem *elem)
+{
+	switch (cf_server_check_mode) {
+	case CHECK_QUERY: return "query";
+	case CHECK_SOCKET: return "socket";
+	default:
+		fatal("borken check mode? should not happen");
+		return NULL;
+	}
+}
+
+static bool set_check_mode(ConfElem *elem, const char *val, PgSocket *console)
+{
+	if (strcasecmp(val, "query") == 0)
+		cf_server_check_mode = CHECK_QUERY;
+	else if (strcasecmp(val, "socket") == 0)
+		cf_server_check_mode = CHECK_SOCKET;
+	else {
+		admin_error(console, "bad check mode: %s", val);
+		return false;
+	}
+	return true;
+}
+
 static const char *get_auth(ConfElem *elem)
 {
 	switch (cf_auth_type) {
@@ -325,6 +402,8 @@ static struct event ev_sigint;
 
 static void handle_sigterm(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_SIGNAL);
+
 	log_info("Got SIGTERM, fast exit");
 	/* pidfile cleanup happens via atexit() */
 	exit(1);
@@ -332,6 +411,8 @@ static void handle_sigterm(int sock, short flags, void *arg)
 
 static void handle_sigint(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_SIGNAL);
+
 	log_info("Got SIGINT, shutting down");
 	if (cf_reboot)
 		fatal("Takeover was in progress, going down immediately");
@@ -349,6 +430,8 @@ static struct event ev_sighup;
 
 static void handle_sigusr1(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_SIGNAL);
+
 	if (cf_pause_mode == P_NONE) {
 		log_info("Got SIGUSR1, pausing all activity");
 		cf_pause_mode = P_PAUSE;
@@ -359,6 +442,8 @@ static void handle_sigusr1(int sock, short flags, void *arg)
 
 static void handle_sigusr2(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_SIGNAL);
+
 	switch (cf_pause_mode) {
 	case P_SUSPEND:
 		log_info("Got SIGUSR2, continuing from SUSPEND");
@@ -382,6 +467,8 @@ static void handle_sigusr2(int sock, short flags, void *arg)
 
 static void handle_sighup(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_SIGNAL);
+
 	log_info("Got SIGHUP re-reading config");
 	load_config(true);
 }
@@ -619,16 +706,24 @@ static void main_loop_once(void)
 	int err;
 
 	reset_time_cache();
+	loop_iter_start();
 
 	err = event_loop(EVLOOP_ONCE);
 	if (err < 0) {
 		if (errno != EINTR)
 			log_warning("event_loop failed: %s", strerror(errno));
 	}
+	loop_events_done();
+
 	per_loop_maint();
+	loop_phase_done(LOOP_PER_LOOP_MAINT);
 	reuse_just_freed_objects();
+	loop_phase_done(LOOP_REUSE_OBJECTS);
 	rescue_timers();
 	per_loop_pooler_maint();
+	loop_phase_done(LOOP_POOLER_MAINT);
+
+	loop_iter_done();
 }
 
 static void takeover_part1(void)
@@ -688,6 +783,7 @@ int main(int argc, char *argv[])
 	init_objects();
 	load_config(false);
 	init_caches();
+	varcache_init();
 
 	/* prefer cmdline over config for username */
 	if (arg_username)
@@ -724,6 +820,10 @@ int main(int argc, char *argv[])
 	if (cf_daemon)
 		go_daemon();
 
+	/* thread must be started after fork */
+	asynclog_setup();
+	evlog_setup();
+
 	/* initialize subsystems, order important */
 	srandom(time(NULL) ^ getpid());
 	if (!event_init())
@@ -0,0 +1,361 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Statement multiplexing.
+ *
+ * In pool_mode=multiplex, autocommit simple queries are written into
+ * a shared server connection, several clients at a time.  Server
+ * answers them in order, so each ReadyForQuery moves answers to next
+ * client in server's queue.  Anything else - extended protocol,
+ * transactions, session state - goes via usual transaction pooling.
+ */
+
+#include "bouncer.h"
+
+/* such statements need a server of their own */
+static const char *const session_cmds[] = {
+	"begin", "start", "set", "reset", "discard", "prepare",
+	"deallocate", "listen", "unlisten", "declare", "lock", "load",
+	"copy",
+	NULL
+};
+
+/* functions that leave state behind, looked for anywhere in query */
+static const char *const session_funcs[] = {
+	"set_config", "pg_advisory_lock", "pg_try_advisory_lock",
+	NULL
+};
+
+/* is there anything after first ';', except whitespace? */
+static bool has_more_statements(const char *q)
+{
+	const char *p = strchr(q, ';');
+
+	if (!p)
+		return false;
+	for (p++; *p; p++) {
+		if (!isspace((unsigned char)*p))
+			return true;
+	}
+	return false;
+}
+
+static bool calls_session_func(const char *q)
+{
+	const char *p;
+	int i;
+
+	for (p = q; *p; p++) {
+		for (i = 0; session_funcs[i]; i++) {
+			if (strncasecmp(p, session_funcs[i], strlen(session_funcs[i])) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Does the query create state that must stay on the server?
+ *
+ * Only decides on first word, so anything else that could hide
+ * a statement is not multiplexed: several statements in one
+ * query, or query that does not start with a word (comments).
+ */
+static bool is_session_query(const char *q)
+{
+	char word[32];
+	int i;
+
+	if (has_more_statements(q) || calls_session_func(q))
+		return true;
+
+	q = sql_next_word(q, word, sizeof(word));
+	if (!word[0])
+		return true;
+	for (i = 0; session_cmds[i]; i++) {
+		if (strcmp(word, session_cmds[i]) == 0)
+			return true;
+	}
+	if (strcmp(word, "create") == 0) {
+		sql_next_word(q, word, sizeof(word));
+		if (strcmp(word, "temp") == 0 || strcmp(word, "temporary") == 0)
+			return true;
+	}
+	return false;
+}
+
+/* can packet go to multiplexed server? */
+bool mux_query_ok(PgSocket *client, PktHdr *pkt)
+{
+	MBuf tmp;
+	const char *q;
+
+	if (pkt->type != 'Q')
+		return false;
+
+	/* it must fit into buffer whole, to be written at once */
+	if (pkt->len > (unsigned)cf_sbuf_len)
+		return false;
+
+	/* decide when it's all here */
+	if (incomplete_pkt(pkt))
+		return true;
+
+	mbuf_copy(&pkt->data, &tmp);
+	q = mbuf_get_string(&tmp);
+	if (!q || is_session_query(q))
+		return false;
+	return true;
+}
+
+/* clear client's places in server queue */
+static void mux_detach(PgSocket *server, PgSocket *client)
+{
+	unsigned i, pos;
+
+	for (i = 0; i < server->mux_count; i++) {
+		pos = (server->mux_head + i) % server->mux_size;
+		if (server->mux_queue[pos] == client)
+			server->mux_queue[pos] = NULL;
+	}
+	if (server->link == client)
+		server->link = NULL;
+
+	client->link = NULL;
+	client->muxed = 0;
+	client->mux_paused = 0;
+	client->mux_pending = 0;
+}
+
+/* turn active server into multiplexed one */
+static bool mux_start(PgSocket *server)
+{
+	unsigned size = cf_mux_depth > 0 ? cf_mux_depth : 1;
+
+	server->mux_queue = zmalloc(size * sizeof(PgSocket *));
+	if (!server->mux_queue)
+		return false;
+	server->mux_size = size;
+	server->mux_head = 0;
+	server->mux_count = 0;
+	return true;
+}
+
+static void mux_stop(PgSocket *server)
+{
+	free(server->mux_queue);
+	server->mux_queue = NULL;
+	server->mux_size = server->mux_head = server->mux_count = 0;
+}
+
+/* idle server first, then multiplexed one with least queries */
+static PgSocket *mux_pick_server(PgPool *pool, PgSocket *client)
+{
+	List *item;
+	PgSocket *server, *best = NULL;
+	uint32_t hash;
+
+	if (cf_pause_mode == P_PAUSE)
+		return NULL;
+
+	server = acquire_idle_server(client);
+	if (server) {
+		if (!mux_start(server)) {
+			disconnect_server(server, true, "no mem for mux queue");
+			return NULL;
+		}
+		return server;
+	}
+
+	hash = varcache_hash(&client->vars);
+	statlist_for_each(item, &pool->active_server_list) {
+		server = container_of(item, PgSocket, head);
+		if (!server->mux_queue || server->close_needed)
+			continue;
+		if (server->mux_count >= server->mux_size)
+			continue;
+		if (varcache_hash(&server->vars) != hash)
+			continue;
+		if (!best || server->mux_count < best->mux_count)
+			best = server;
+	}
+	return best;
+}
+
+/* stop reading from client until its queued answers are in */
+bool mux_wait(PgSocket *client)
+{
+	slog_debug(client, "mux_wait");
+	client->mux_paused = 1;
+	if (!sbuf_pause(&client->sbuf))
+		disconnect_client(client, true, "pause failed");
+	return false;
+}
+
+/* queue query on multiplexed server, false if client has to wait */
+bool mux_send_query(PgSocket *client, PktHdr *pkt)
+{
+	PgSocket *server;
+	unsigned pos, limit;
+
+	/* need whole packet */
+	if (incomplete_pkt(pkt))
+		return false;
+
+	if (client->muxed) {
+		/* keep order of client's own queries */
+		server = client->link;
+		if (server->mux_count >= server->mux_size)
+			return mux_wait(client);
+	} else {
+		server = mux_pick_server(client->pool, client);
+		if (!server) {
+			if (check_fast_fail(client))
+				pause_client(client);
+			return false;
+		}
+	}
+
+	pos = (server->mux_head + server->mux_count) % server->mux_size;
+	server->mux_queue[pos] = client;
+	if (server->mux_count++ == 0)
+		server->link = client;
+	server->ready = 0;
+
+	client->link = server;
+	client->muxed = 1;
+	client->mux_pending++;
+	client->pool->stats.client_bytes += pkt->len;
+	if (cf_query_digest_size > 0)
+		digest_client_query(client, pkt);
+	USDT_PROBE3(query__start, client->id, server->id,
+		    get_cached_time() - client->query_start);
+
+	/* whole packet goes at once, so writes from clients do not mix */
+	limit = server->mux_size * (cf_sbuf_len + STARTUP_BUF);
+	if (!sbuf_write_ordered(&server->sbuf, pkt->data.data, pkt->len, limit)) {
+		disconnect_server(server, true, "multiplexed write failed");
+		return false;
+	}
+
+	sbuf_prepare_skip(&client->sbuf, pkt->len);
+	return true;
+}
+
+/* route answer packet from multiplexed server */
+bool mux_server_packet(PgSocket *server, PktHdr *pkt, bool ready)
+{
+	PgSocket *client = server->mux_queue[server->mux_head];
+	PgPool *pool = server->pool;
+	PgSocket *waiter;
+
+	/* queries of other clients would go into COPY data */
+	if (pkt->type == 'G' || pkt->type == 'W') {
+		disconnect_server(server, true, "COPY in multiplexed query");
+		return false;
+	}
+
+	if (client)
+		sbuf_prepare_send(&server->sbuf, &client->sbuf, pkt->len);
+	else
+		sbuf_prepare_skip(&server->sbuf, pkt->len);
+
+	if (pkt->type != 'Z')
+		return true;
+
+	/* following queries must not run inside it */
+	if (!ready) {
+		disconnect_server(server, true, "multiplexed query left transaction open");
+		return false;
+	}
+
+	/* answer is complete, move to next */
+	server->mux_queue[server->mux_head] = NULL;
+	server->mux_head = (server->mux_head + 1) % server->mux_size;
+	server->mux_count--;
+	server->link = server->mux_count ? server->mux_queue[server->mux_head] : NULL;
+
+	if (server->mux_count == 0) {
+		/* released on flush, as usual */
+		mux_stop(server);
+		server->ready = 1;
+	} else if (cf_pause_mode != P_PAUSE) {
+		/* room for one more */
+		waiter = first_socket(&pool->waiting_client_list);
+		if (waiter)
+			activate_client(waiter);
+	}
+
+	if (client) {
+		if (client->query_start) {
+			usec_t total = get_cached_time() - client->query_start;
+			if (cf_log_slow_queries > 0 && total >= (usec_t)cf_log_slow_queries * 1000)
+				log_slow_query(client, total, 0);
+			pool->stats.query_time += total;
+			digest_query_done(client);
+			USDT_PROBE4(query__done, client->id, server->id, total, total);
+			client->query_start = 0;
+		}
+		if (--client->mux_pending == 0) {
+			client->link = NULL;
+			client->muxed = 0;
+			if (client->mux_paused) {
+				client->mux_paused = 0;
+				sbuf_continue(&client->sbuf);
+			}
+		}
+	}
+
+	/* woken clients may have caused server close */
+	if (server->state == SV_JUSTFREE || server->state == SV_FREE)
+		return false;
+	return true;
+}
+
+/* client is going away, server will skip its answers */
+void mux_forget_client(PgSocket *client)
+{
+	PgSocket *server = client->link;
+	bool sending = (server->link == client || server->sbuf.dst == &client->sbuf)
+		       && !sbuf_is_empty(&server->sbuf);
+
+	mux_detach(server, client);
+
+	/* its answer may be half-sent already */
+	if (sending)
+		disconnect_server(server, true, "multiplexed client closed");
+}
+
+/* server is going away, drop clients waiting for answers */
+void mux_close_server(PgSocket *server, const char *reason)
+{
+	PgSocket *client;
+	unsigned i, pos;
+
+	for (i = 0; i < server->mux_count; i++) {
+		pos = (server->mux_head + i) % server->mux_size;
+		client = server->mux_queue[pos];
+		if (!client)
+			continue;
+		mux_detach(server, client);
+		disconnect_client(client, true, "%s", reason);
+	}
+	mux_stop(server);
+	server->link = NULL;
+}
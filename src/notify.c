@@ -0,0 +1,635 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * LISTEN/NOTIFY fan-out for transaction pooling.
+ *
+ * Client LISTEN and UNLISTEN are not sent to pooled servers, instead
+ * they are registered in pool's channel list and answered here.  One
+ * listener connection per pool LISTENs on all channels that have
+ * subscribers, and notifications it gets are copied to them.
+ *
+ * Notification can be given to client only between packets of other
+ * streams, so for client linked to server they are kept until the
+ * client is idle again.
+ */
+
+#include "bouncer.h"
+
+/* max amount of notifications kept for busy client */
+#define NOTIFY_PENDING_MAX	((unsigned)cf_sbuf_len * 32)
+
+typedef struct NotifyChannel {
+	List head;		/* pool->channel_list */
+	List sub_list;		/* NotifySub->chan_head */
+	uint32_t listen_seq;	/* pool->listen_sent of its LISTEN, 0 if not sent */
+	bool busy;		/* in fanout(), must not be freed */
+	char name[MAX_CHANNEL_NAME];
+} NotifyChannel;
+
+typedef struct NotifySub {
+	List chan_head;		/* NotifyChannel->sub_list */
+	List client_head;	/* NotifyClient->sub_list */
+	NotifyChannel *chan;
+	NotifyClient *nc;
+	const char *fail_reason;	/* set in fanout() if client must go */
+} NotifySub;
+
+struct NotifyClient {
+	List sub_list;		/* NotifySub->client_head */
+	List pending_head;	/* notify_pending_list, if pending_len > 0 */
+	PgSocket *client;
+
+	uint8_t *pending;	/* packets waiting until client is idle */
+	unsigned pending_len;
+	unsigned pending_alloc;
+};
+
+/* clients that have notifications waiting */
+static LIST(notify_pending_list);
+
+/* copy channel name as Postgres would see it */
+static const char *parse_channel(const char *p, char *dst)
+{
+	unsigned len = 0;
+
+	if (*p == '"') {
+		for (p++; *p; p++) {
+			if (*p == '"') {
+				if (p[1] != '"')
+					break;
+				p++;
+			}
+			if (len >= MAX_CHANNEL_NAME - 1)
+				return NULL;
+			dst[len++] = *p;
+		}
+		if (*p != '"')
+			return NULL;
+		p++;
+	} else {
+		while (*p && (isalnum((unsigned char)*p) || *p == '_' || *p == '$')) {
+			if (len >= MAX_CHANNEL_NAME - 1)
+				return NULL;
+			dst[len++] = tolower((unsigned char)*p);
+			p++;
+		}
+	}
+	if (len == 0)
+		return NULL;
+	dst[len] = 0;
+	return p;
+}
+
+/*
+ * Is query a single LISTEN or UNLISTEN?  For UNLISTEN *
+ * the channel is returned as empty string.
+ */
+static bool parse_listen(const char *q, bool *listen, char *chan)
+{
+	char word[16];
+	const char *p;
+
+	p = sql_next_word(q, word, sizeof(word));
+	if (strcmp(word, "listen") == 0)
+		*listen = true;
+	else if (strcmp(word, "unlisten") == 0)
+		*listen = false;
+	else
+		return false;
+
+	while (*p && isspace((unsigned char)*p))
+		p++;
+	if (!*listen && *p == '*') {
+		chan[0] = 0;
+		p++;
+	} else {
+		p = parse_channel(p, chan);
+		if (!p)
+			return false;
+	}
+
+	/* nothing else may follow */
+	while (*p && (isspace((unsigned char)*p) || *p == ';'))
+		p++;
+	return *p == 0;
+}
+
+/* can packets be written to client without cutting into other stream? */
+static bool client_stream_idle(PgSocket *client)
+{
+	List *item;
+	PgSocket *server;
+
+	if (client->link || client->muxed)
+		return false;
+	if (cf_pool_mode != POOL_MUX)
+		return true;
+
+	/* multiplexed answer may still be in server buffer */
+	statlist_for_each(item, &client->pool->active_server_list) {
+		server = container_of(item, PgSocket, head);
+		if (sbuf_is_empty(&server->sbuf))
+			continue;
+		if (server->sbuf.dst == &client->sbuf || server->sbuf.next_dst == &client->sbuf)
+			return false;
+	}
+	return true;
+}
+
+static NotifyClient *get_notify_client(PgSocket *client)
+{
+	NotifyClient *nc = client->notify;
+
+	if (nc)
+		return nc;
+	nc = zmalloc(sizeof(*nc));
+	if (!nc)
+		return NULL;
+	list_init(&nc->sub_list);
+	list_init(&nc->pending_head);
+	nc->client = client;
+	client->notify = nc;
+	return nc;
+}
+
+/* keep packets for later, returns reason on failure */
+static const char *add_pending(NotifyClient *nc, const void *data, unsigned len)
+{
+	unsigned need = nc->pending_len + len;
+	uint8_t *tmp;
+
+	if (need > NOTIFY_PENDING_MAX)
+		return "too many notifications waiting";
+	if (need > nc->pending_alloc) {
+		tmp = realloc(nc->pending, need * 2);
+		if (!tmp)
+			return "no memory for notification";
+		nc->pending = tmp;
+		nc->pending_alloc = need * 2;
+	}
+	if (nc->pending_len == 0)
+		list_append(&nc->pending_head, &notify_pending_list);
+	memcpy(nc->pending + nc->pending_len, data, len);
+	nc->pending_len += len;
+	return NULL;
+}
+
+/* queue whole packets to client, now or when it is idle; reason on failure */
+static const char *queue_notify(PgSocket *client, const void *data, unsigned len)
+{
+	NotifyClient *nc = client->notify;
+
+	if ((!nc || !nc->pending_len) && client_stream_idle(client)) {
+		if (sbuf_write_ordered(&client->sbuf, data, len, NOTIFY_PENDING_MAX))
+			return NULL;
+		return "notification write failed";
+	}
+
+	nc = get_notify_client(client);
+	if (!nc)
+		return "no memory for notification";
+	return add_pending(nc, data, len);
+}
+
+/* send whole packets to client, drop client on failure */
+static bool notify_send(PgSocket *client, const void *data, unsigned len)
+{
+	const char *reason = queue_notify(client, data, len);
+
+	if (reason) {
+		disconnect_client(client, true, "%s", reason);
+		return false;
+	}
+	return true;
+}
+
+/* build LISTEN/UNLISTEN query for listener connection */
+static void format_listen(char *dst, unsigned dstlen, const char *cmd, const char *name)
+{
+	unsigned pos;
+
+	pos = snprintf(dst, dstlen, "%s \"", cmd);
+	for (; *name && pos < dstlen - 3; name++) {
+		if (*name == '"')
+			dst[pos++] = '"';
+		dst[pos++] = *name;
+	}
+	dst[pos++] = '"';
+	dst[pos] = 0;
+}
+
+/* tell listener connection about channel change */
+static void listener_command(PgPool *pool, const char *cmd, NotifyChannel *chan)
+{
+	PgSocket *server = first_socket(&pool->listen_server_list);
+	char q[MAX_CHANNEL_NAME * 2 + 16];
+	bool res;
+
+	if (!server) {
+		launch_listen_connection(pool);
+		return;
+	}
+
+	/* all channels are sent after login */
+	if (!server->ready)
+		return;
+
+	format_listen(q, sizeof(q), cmd, chan->name);
+	slog_debug(server, "listener: %s", q);
+	SEND_generic(res, server, 'Q', "s", q);
+	if (!res) {
+		disconnect_server(server, true, "listener write failed");
+		return;
+	}
+	chan->listen_seq = ++pool->listen_sent;
+}
+
+/* has listener answered to LISTEN on channel? */
+static bool channel_ready(PgPool *pool, NotifyChannel *chan)
+{
+	PgSocket *server = first_socket(&pool->listen_server_list);
+
+	if (!server || !server->ready || !chan->listen_seq)
+		return false;
+	return chan->listen_seq <= pool->listen_done;
+}
+
+static NotifyChannel *find_channel(PgPool *pool, const char *name)
+{
+	List *item;
+	NotifyChannel *chan;
+
+	list_for_each(item, &pool->channel_list) {
+		chan = container_of(item, NotifyChannel, head);
+		if (strcmp(chan->name, name) == 0)
+			return chan;
+	}
+	return NULL;
+}
+
+/* add client to channel, NULL if no memory */
+static NotifyChannel *subscribe(PgSocket *client, const char *name)
+{
+	NotifyClient *nc;
+	NotifyChannel *chan;
+	NotifySub *sub;
+	List *item;
+
+	nc = get_notify_client(client);
+	if (!nc)
+		return NULL;
+
+	/* already listening */
+	list_for_each(item, &nc->sub_list) {
+		sub = container_of(item, NotifySub, client_head);
+		if (strcmp(sub->chan->name, name) == 0)
+			return sub->chan;
+	}
+
+	sub = zmalloc(sizeof(*sub));
+	if (!sub)
+		return NULL;
+
+	slog_debug(client, "LISTEN \"%s\"", name);
+
+	chan = find_channel(client->pool, name);
+	if (!chan) {
+		chan = zmalloc(sizeof(*chan));
+		if (!chan) {
+			free(sub);
+			return NULL;
+		}
+		list_init(&chan->sub_list);
+		safe_strcpy(chan->name, name, sizeof(chan->name));
+		list_append(&chan->head, &client->pool->channel_list);
+		listener_command(client->pool, "LISTEN", chan);
+	}
+
+	sub->chan = chan;
+	sub->nc = nc;
+	list_append(&sub->chan_head, &chan->sub_list);
+	list_append(&sub->client_head, &nc->sub_list);
+	return chan;
+}
+
+/* last subscriber is gone, stop listening */
+static void drop_channel(PgPool *pool, NotifyChannel *chan)
+{
+	listener_command(pool, "UNLISTEN", chan);
+	list_del(&chan->head);
+	free(chan);
+}
+
+static void drop_sub(PgPool *pool, NotifySub *sub)
+{
+	NotifyChannel *chan = sub->chan;
+
+	list_del(&sub->chan_head);
+	list_del(&sub->client_head);
+	free(sub);
+
+	/* fanout() drops it when done */
+	if (list_empty(&chan->sub_list) && !chan->busy)
+		drop_channel(pool, chan);
+}
+
+/* drop subscription, or all of them if name is empty */
+static void unsubscribe(PgSocket *client, const char *name)
+{
+	NotifyClient *nc = client->notify;
+	NotifySub *sub;
+	List *item, *tmp;
+
+	if (!nc)
+		return;
+
+	list_for_each_safe(item, &nc->sub_list, tmp) {
+		sub = container_of(item, NotifySub, client_head);
+		if (!*name || strcmp(sub->chan->name, name) == 0)
+			drop_sub(client->pool, sub);
+	}
+}
+
+/* should the query be answered here? */
+bool notify_query_ok(PgSocket *client, PktHdr *pkt)
+{
+	char chan[MAX_CHANNEL_NAME];
+	const char *q;
+	bool listen;
+	MBuf tmp;
+
+	if (!cf_listen_fanout || cf_pool_mode == POOL_SESSION)
+		return false;
+	if (pkt->type != 'Q' || client->link || client->muxed)
+		return false;
+
+	/* LISTEN is short, longer queries need not wait */
+	if (pkt->len > (unsigned)cf_sbuf_len)
+		return false;
+
+	/* decide when it's all here */
+	if (incomplete_pkt(pkt))
+		return true;
+
+	mbuf_copy(&pkt->data, &tmp);
+	q = mbuf_get_string(&tmp);
+	return q && parse_listen(q, &listen, chan);
+}
+
+/* register LISTEN or UNLISTEN from client and answer it */
+bool notify_client_query(PgSocket *client, PktHdr *pkt)
+{
+	char name[MAX_CHANNEL_NAME];
+	NotifyChannel *chan;
+	uint8_t data[64];
+	PktBuf buf;
+	bool listen = false;
+	MBuf tmp;
+
+	/* need whole packet */
+	if (incomplete_pkt(pkt))
+		return false;
+
+	mbuf_copy(&pkt->data, &tmp);
+	if (!parse_listen(mbuf_get_string(&tmp), &listen, name)) {
+		disconnect_client(client, true, "bad LISTEN packet");
+		return false;
+	}
+
+	if (listen) {
+		chan = subscribe(client, name);
+		if (!chan) {
+			disconnect_client(client, true, "no memory for LISTEN");
+			return false;
+		}
+
+		/* answer only when notifications really arrive */
+		if (!channel_ready(client->pool, chan)) {
+			client->listen_wait = 1;
+			if (!sbuf_pause(&client->sbuf))
+				disconnect_client(client, true, "pause failed");
+			return false;
+		}
+	} else
+		unsubscribe(client, name);
+
+	client->query_start = 0;
+
+	pktbuf_static(&buf, data, sizeof(data));
+	pktbuf_write_CommandComplete(&buf, listen ? "LISTEN" : "UNLISTEN");
+	pktbuf_write_ReadyForQuery(&buf);
+	if (!notify_send(client, buf.buf, buf.write_pos))
+		return false;
+
+	sbuf_prepare_skip(&client->sbuf, pkt->len);
+	return true;
+}
+
+/* listener logged in, LISTEN on all channels */
+bool notify_server_ready(PgSocket *server)
+{
+	PgPool *pool = server->pool;
+	NotifyChannel *chan;
+	PktBuf *buf;
+	List *item;
+	char q[MAX_CHANNEL_NAME * 2 + 16];
+	bool res;
+
+	slog_debug(server, "listener login ok");
+
+	pool->listen_sent = pool->listen_done = 0;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		disconnect_server(server, true, "no memory for listener");
+		return false;
+	}
+	list_for_each(item, &server->pool->channel_list) {
+		chan = container_of(item, NotifyChannel, head);
+		format_listen(q, sizeof(q), "LISTEN", chan->name);
+		pktbuf_write_generic(buf, 'Q', "s", q);
+		chan->listen_seq = ++pool->listen_sent;
+	}
+	res = pktbuf_send_immidiate(buf, server);
+	pktbuf_free(buf);
+	if (!res) {
+		disconnect_server(server, true, "listener write failed");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Resume clients whose LISTEN is done, or drop them with reason.
+ * Woken client may drop channels, so scan is restarted each time.
+ */
+static void wake_listen_waiters(PgPool *pool, const char *fail_reason)
+{
+	NotifyChannel *chan;
+	NotifySub *sub;
+	PgSocket *client;
+	List *item, *item2;
+
+restart:
+	list_for_each(item, &pool->channel_list) {
+		chan = container_of(item, NotifyChannel, head);
+		if (!fail_reason && !channel_ready(pool, chan))
+			continue;
+		list_for_each(item2, &chan->sub_list) {
+			sub = container_of(item2, NotifySub, chan_head);
+			client = sub->nc->client;
+			if (!client->listen_wait)
+				continue;
+			client->listen_wait = 0;
+			if (fail_reason)
+				disconnect_client(client, true, "%s", fail_reason);
+			else
+				sbuf_continue(&client->sbuf);
+			goto restart;
+		}
+	}
+}
+
+/* listener could not log in, LISTEN cannot be answered */
+void notify_listener_failed(PgPool *pool)
+{
+	wake_listen_waiters(pool, "listener connection failed");
+}
+
+/* copy notification to subscribers */
+static void fanout(PgPool *pool, PktHdr *pkt)
+{
+	NotifyChannel *chan;
+	NotifySub *sub;
+	List *item;
+	const char *name;
+	MBuf data;
+
+	mbuf_copy(&pkt->data, &data);
+	mbuf_get_uint32(&data);
+	name = mbuf_get_string(&data);
+	if (!name)
+		return;
+
+	chan = find_channel(pool, name);
+	if (!chan)
+		return;
+
+	/*
+	 * Closing a client may close others too (eg. via multiplexed
+	 * server), so failed ones are only marked while walking the list.
+	 * They are dropped afterwards, restarting after each one, and
+	 * the channel is kept until then.
+	 */
+	list_for_each(item, &chan->sub_list) {
+		sub = container_of(item, NotifySub, chan_head);
+		sub->fail_reason = queue_notify(sub->nc->client, pkt->data.data, pkt->len);
+	}
+
+	chan->busy = true;
+restart:
+	list_for_each(item, &chan->sub_list) {
+		sub = container_of(item, NotifySub, chan_head);
+		if (sub->fail_reason) {
+			disconnect_client(sub->nc->client, true, "%s", sub->fail_reason);
+			goto restart;
+		}
+	}
+	chan->busy = false;
+
+	if (list_empty(&chan->sub_list))
+		drop_channel(pool, chan);
+}
+
+/* process packet from listener connection */
+bool notify_server_packet(PgSocket *server, PktHdr *pkt)
+{
+	switch (pkt->type) {
+	case 'A':		/* NotificationResponse */
+		if (incomplete_pkt(pkt)) {
+			if (pkt->len <= (unsigned)cf_sbuf_len)
+				return false;
+			slog_warning(server, "notification larger than pkt_buf, dropped");
+			break;
+		}
+		fanout(server->pool, pkt);
+		break;
+	case 'E':		/* ErrorResponse */
+		if (incomplete_pkt(pkt) && pkt->len <= (unsigned)cf_sbuf_len)
+			return false;
+		log_server_error("S: listener query failed", pkt);
+		break;
+	case 'Z':		/* ReadyForQuery */
+		server->pool->listen_done++;
+		wake_listen_waiters(server->pool, NULL);
+		break;
+	default:
+		/* answers to LISTEN/UNLISTEN, ParameterStatus, notices */
+		break;
+	}
+	sbuf_prepare_skip(&server->sbuf, pkt->len);
+	return true;
+}
+
+/* client is going away */
+void notify_forget_client(PgSocket *client)
+{
+	NotifyClient *nc = client->notify;
+	NotifySub *sub;
+
+	if (!nc)
+		return;
+
+	while (!list_empty(&nc->sub_list)) {
+		sub = container_of(nc->sub_list.next, NotifySub, client_head);
+		drop_sub(client->pool, sub);
+	}
+	if (nc->pending_len)
+		list_del(&nc->pending_head);
+	free(nc->pending);
+	free(nc);
+	client->notify = NULL;
+}
+
+/* does pool need listener connection? */
+bool notify_pool_listens(PgPool *pool)
+{
+	return !list_empty(&pool->channel_list);
+}
+
+/* give waiting notifications to clients that are idle now */
+void notify_flush_pending(void)
+{
+	NotifyClient *nc;
+	List *item, *tmp;
+	bool res;
+
+	list_for_each_safe(item, &notify_pending_list, tmp) {
+		nc = container_of(item, NotifyClient, pending_head);
+		if (!client_stream_idle(nc->client))
+			continue;
+
+		list_del(&nc->pending_head);
+		res = sbuf_write_ordered(&nc->client->sbuf, nc->pending, nc->pending_len,
+					 NOTIFY_PENDING_MAX);
+		nc->pending_len = 0;
+		if (!res)
+			disconnect_client(nc->client, true, "notification write failed");
+	}
+}
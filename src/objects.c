@@ -51,6 +51,10 @@ ObjectCache *iobuf_cache;
 static STATLIST(justfree_client_list);
 static STATLIST(justfree_server_list);
 
+/* last ids given to sockets and pools */
+static uint32_t last_socket_id;
+static uint32_t last_pool_id;
+
 /* init autodb idle list */
 STATLIST(autodatabase_idle_list);
 
@@ -98,9 +102,9 @@ static int user_node_cmp(long userptr, Node *node)
 void init_objects(void)
 {
 	tree_init(&user_tree, user_node_cmp, NULL);
-	user_cache = objcache_create("user_cache", sizeof(PgUser), 0, NULL);
-	db_cache = objcache_create("db_cache", sizeof(PgDatabase), 0, NULL);
-	pool_cache = objcache_create("pool_cache", sizeof(PgPool), 0, NULL);
+	user_cache = objcache_create("user_cache", sizeof(PgUser), 0, NULL, 0);
+	db_cache = objcache_create("db_cache", sizeof(PgDatabase), 0, NULL, 0);
+	pool_cache = objcache_create("pool_cache", sizeof(PgPool), 0, NULL, 0);
 
 	if (!user_cache || !db_cache || !pool_cache)
 		fatal("cannot create initial caches");
@@ -115,9 +119,11 @@ static void do_iobuf_reset(void *arg)
 /* initialization after config loading */
 void init_caches(void)
 {
-	server_cache = objcache_create("server_cache", sizeof(PgSocket), 0, construct_server);
-	client_cache = objcache_create("client_cache", sizeof(PgSocket), 0, construct_client);
-	iobuf_cache = objcache_create("iobuf_cache", IOBUF_SIZE, 0, do_iobuf_reset);
+	int flags = cf_huge_pages ? OBJCACHE_ARENA : 0;
+
+	server_cache = objcache_create("server_cache", sizeof(PgSocket), CACHELINE_SIZE, construct_server, flags);
+	client_cache = objcache_create("client_cache", sizeof(PgSocket), CACHELINE_SIZE, construct_client, flags);
+	iobuf_cache = objcache_create("iobuf_cache", IOBUF_SIZE, 0, do_iobuf_reset, flags);
 }
 
 /* state change means moving between lists */
@@ -153,6 +159,7 @@ void change_client_state(PgSocket *client, SocketState newstate)
 	/* put to new location */
 	switch (client->state) {
 	case CL_FREE:
+		varcache_clean(&client->vars);
 		obj_free(client_cache, client);
 		break;
 	case CL_JUSTFREE:
@@ -190,6 +197,12 @@ void change_server_state(PgSocket *server, SocketState newstate)
 	case SV_LOGIN:
 		statlist_remove(&server->head, &pool->new_server_list);
 		break;
+	case SV_CANCEL:
+		statlist_remove(&server->head, &pool->cancel_server_list);
+		break;
+	case SV_LISTEN:
+		statlist_remove(&server->head, &pool->listen_server_list);
+		break;
 	case SV_USED:
 		statlist_remove(&server->head, &pool->used_server_list);
 		break;
@@ -211,6 +224,7 @@ void change_server_state(PgSocket *server, SocketState newstate)
 	/* put to new location */
 	switch (server->state) {
 	case SV_FREE:
+		varcache_clean(&server->vars);
 		obj_free(server_cache, server);
 		break;
 	case SV_JUSTFREE:
@@ -219,6 +233,12 @@ void change_server_state(PgSocket *server, SocketState newstate)
 	case SV_LOGIN:
 		statlist_append(&server->head, &pool->new_server_list);
 		break;
+	case SV_CANCEL:
+		statlist_append(&server->head, &pool->cancel_server_list);
+		break;
+	case SV_LISTEN:
+		statlist_append(&server->head, &pool->listen_server_list);
+		break;
 	case SV_USED:
 		/* use LIFO */
 		statlist_prepend(&server->head, &pool->used_server_list);
@@ -227,6 +247,12 @@ void change_server_state(PgSocket *server, SocketState newstate)
 		statlist_append(&server->head, &pool->tested_server_list);
 		break;
 	case SV_IDLE:
+		/* pending reset will restore initial parameters */
+		if (server->reset_pending)
+			server->vars_hash = varcache_hash(&pool->orig_vars);
+		else
+			server->vars_hash = varcache_hash(&server->vars);
+
 		if (server->close_needed || cf_server_round_robin)
 			/* try to avoid immediate usage then */
 			statlist_append(&server->head, &pool->idle_server_list);
@@ -432,6 +458,9 @@ static PgPool *new_pool(PgDatabase *db, PgUser *user)
 	statlist_init(&pool->tested_server_list, "tested_server_list");
 	statlist_init(&pool->used_server_list, "used_server_list");
 	statlist_init(&pool->new_server_list, "new_server_list");
+	statlist_init(&pool->cancel_server_list, "cancel_server_list");
+	statlist_init(&pool->listen_server_list, "listen_server_list");
+	list_init(&pool->channel_list);
 	statlist_init(&pool->cancel_req_list, "cancel_req_list");
 
 	list_append(&pool->map_head, &user->pool_list);
@@ -439,6 +468,10 @@ static PgPool *new_pool(PgDatabase *db, PgUser *user)
 	/* keep pools in db/user order to make stats faster */
 	put_in_order(&pool->head, &pool_list, cmp_pool);
 
+	pool->id = ++last_pool_id;
+	if (evlog_active)
+		evlog_pool_create(pool);
+
 	return pool;
 }
 
@@ -461,11 +494,12 @@ PgPool *get_pool(PgDatabase *db, PgUser *user)
 }
 
 /* deactivate socket and put into wait queue */
-static void pause_client(PgSocket *client)
+void pause_client(PgSocket *client)
 {
 	Assert(client->state == CL_ACTIVE);
 
 	slog_debug(client, "pause_client");
+	USDT_PROBE2(client__wait, client->id, client->pool->id);
 	change_client_state(client, CL_WAITING);
 	if (!sbuf_pause(&client->sbuf))
 		disconnect_client(client, true, "pause failed");
@@ -477,6 +511,8 @@ void activate_client(PgSocket *client)
 	Assert(client->state == CL_WAITING);
 
 	slog_debug(client, "activate_client");
+	USDT_PROBE3(client__activate, client->id, client->pool->id,
+		    get_cached_time() - client->request_time);
 	change_client_state(client, CL_ACTIVE);
 	sbuf_continue(&client->sbuf);
 }
@@ -514,13 +550,131 @@ bool check_fast_fail(PgSocket *client)
 	return false;
 }
 
+/*
+ * Predicted time a new request would wait for a server: requests
+ * queued ahead of it times average server time, spread over the
+ * servers the pool can have.
+ */
+usec_t predict_wait(PgPool *pool)
+{
+	int servers = pool_target_size(pool);
+	int queue = statlist_count(&pool->waiting_client_list);
+
+	if (!statlist_empty(&pool->idle_server_list) || servers <= 0)
+		return 0;
+	return (queue + 1) * pool->service_time / servers;
+}
+
+/*
+ * Admission control: reject new work early if it would wait
+ * longer than admission_max_wait anyway.  Error is sent
+ * to client, caller decides whether to disconnect.
+ */
+bool check_admission(PgSocket *client, bool send_ready)
+{
+	char msg[128];
+	usec_t wait;
+
+	if (cf_admission_max_wait <= 0 || client->pool->db->admin)
+		return true;
+	wait = predict_wait(client->pool);
+	if (wait <= (usec_t)cf_admission_max_wait * USEC / 1000)
+		return true;
+
+	snprintf(msg, sizeof(msg), "pooler overloaded: predicted wait %d ms exceeds admission_max_wait",
+		 (int)(wait * 1000 / USEC));
+	send_pooler_error_code(client, send_ready, "53300", msg);
+	return false;
+}
+
+/*
+ * Get first usable idle server, preferring one whose parameters
+ * already match client's, so no SET is needed.
+ */
+static PgSocket *pick_idle_server(PgPool *pool, PgSocket *client)
+{
+	List *item, *tmp;
+	PgSocket *server, *first = NULL;
+	uint32_t hash = varcache_hash(&client->vars);
+
+	statlist_for_each_safe(item, &pool->idle_server_list, tmp) {
+		server = container_of(item, PgSocket, head);
+		if (server->close_needed) {
+			disconnect_server(server, true, "obsolete connection");
+			continue;
+		} else if (!server->ready) {
+			disconnect_server(server, true, "idle server got dirty");
+			continue;
+		}
+		if (server->vars_hash == hash)
+			return server;
+		if (!first)
+			first = server;
+	}
+	return first;
+}
+
+/*
+ * Send pipelined reset query and var changes in one go,
+ * before client packet gets forwarded to server.  Client does
+ * not need to wait for answers, they are skipped in server.c.
+ */
+static bool prepare_server(PgSocket *server, PgSocket *client, bool *varchange_p)
+{
+	PktBuf pkt;
+	uint8_t buf[STARTUP_BUF * 2];
+
+	pktbuf_static(&pkt, buf, sizeof(buf));
+
+	if (server->reset_pending) {
+		slog_debug(server, "Resetting: %s", cf_server_reset_query);
+		pktbuf_write_generic(&pkt, 'Q', "s", cf_server_reset_query);
+		server->reset_pending = 0;
+		server->resetting = 1;
+
+		/* reset query is expected to restore session defaults */
+		varcache_copy(&server->vars, &server->pool->orig_vars);
+	}
+
+	*varchange_p = varcache_apply(server, client, &pkt);
+
+	if (!pktbuf_written(&pkt))
+		return true;
+	return pktbuf_send_immidiate(&pkt, server);
+}
+
+/*
+ * Take idle server into use for client.  Pending reset and
+ * parameter changes are sent, caller should link it.
+ */
+PgSocket *acquire_idle_server(PgSocket *client)
+{
+	PgSocket *server;
+	bool varchange = false;
+
+	server = pick_idle_server(client->pool, client);
+	if (!server)
+		return NULL;
+	Assert(server->state == SV_IDLE);
+
+	/* send pending reset and var changes */
+	if (!prepare_server(server, client, &varchange)) {
+		disconnect_server(server, true, "var change failed");
+		return NULL;
+	}
+	change_server_state(server, SV_ACTIVE);
+
+	/* client data goes right after SET, answer will be skipped */
+	if (varchange)
+		server->setting_vars = 1;
+	return server;
+}
+
 /* link if found, otherwise put into wait queue */
 bool find_server(PgSocket *client)
 {
-	PgPool *pool = client->pool;
 	PgSocket *server;
 	bool res;
-	bool varchange = false;
 
 	Assert(client->state == CL_ACTIVE);
 
@@ -531,47 +685,20 @@ bool find_server(PgSocket *client)
 	if (cf_pause_mode == P_PAUSE) {
 		server = NULL;
 	} else {
-		while (1) {
-			server = first_socket(&pool->idle_server_list);
-			if (!server)
-				break;
-			else if (server->close_needed)
-				disconnect_server(server, true, "obsolete connection");
-			else if (!server->ready)
-				disconnect_server(server, true, "idle server got dirty");
-			else
-				break;
-		}
-
+		server = acquire_idle_server(client);
 		if (!server && !check_fast_fail(client))
 			return false;
-
-	}
-	Assert(!server || server->state == SV_IDLE);
-
-	/* send var changes */
-	if (server) {
-		res = varcache_apply(server, client, &varchange);
-		if (!res) {
-			disconnect_server(server, true, "var change failed");
-			server = NULL;
-		}
 	}
 
 	/* link or send to waiters list */
 	if (server) {
 		client->link = server;
 		server->link = client;
-		change_server_state(server, SV_ACTIVE);
-		if (varchange) {
-			server->setting_vars = 1;
-			server->ready = 0;
-			res = false; /* don't process client data yet */
-			if (!sbuf_pause(&client->sbuf))
-				disconnect_client(client, true, "pause failed");
-		} else
-			res = true;
+		evlog_event(EVLOG_SERVER_LINK, client, client->pool, server->id, NULL);
+		USDT_PROBE3(server__hit, client->id, client->pool->id, server->id);
+		res = true;
 	} else {
+		USDT_PROBE2(server__miss, client->id, client->pool->id);
 		pause_client(client);
 		res = false;
 	}
@@ -607,6 +734,7 @@ static bool reset_on_release(PgSocket *server)
 
 	slog_debug(server, "Resetting: %s", cf_server_reset_query);
 	SEND_generic(res, server, 'Q', "s", cf_server_reset_query);
+	varcache_forget_unreported(&server->vars, &server->pool->orig_vars);
 	if (!res)
 		disconnect_server(server, false, "reset query failed");
 	return res;
@@ -640,13 +768,24 @@ bool release_server(PgSocket *server)
 
 	Assert(server->ready);
 
+	evlog_event(EVLOG_SERVER_RELEASE, server, pool,
+		    server->link ? server->link->id : 0, NULL);
+	USDT_PROBE3(server__release, server->id, pool->id,
+		    server->link ? server->link->id : 0);
+
 	/* remove from old list */
 	switch (server->state) {
 	case SV_ACTIVE:
-		server->link->link = NULL;
-		server->link = NULL;
+		/* multiplexed server may have no client left */
+		if (server->link) {
+			server->link->link = NULL;
+			server->link = NULL;
+		}
 
-		if (*cf_server_reset_query)
+		if (*cf_server_reset_query && cf_server_reset_pipeline)
+			/* reset is sent together with next query */
+			server->reset_pending = 1;
+		else if (*cf_server_reset_query)
 			/* notify reset is required */
 			newstate = SV_TESTED;
 		else if (cf_server_check_delay == 0 && *cf_server_check_query)
@@ -699,6 +838,7 @@ void disconnect_server(PgSocket *server, bool notify, const char *reason, ...)
 	static const uint8_t pkt_term[] = {'X', 0,0,0,4};
 	int send_term = 1;
 	usec_t now = get_cached_time();
+	const char *fmt = reason;
 	char buf[128];
 	va_list ap;
 
@@ -710,9 +850,17 @@ void disconnect_server(PgSocket *server, bool notify, const char *reason, ...)
 	if (cf_log_disconnections)
 		slog_info(server, "closing because: %s (age=%llu)", reason,
 			  (now - server->connect_time) / USEC);
+	/* template only, formatted text could fill the text table */
+	evlog_event(EVLOG_SERVER_CLOSE, server, pool,
+		    (now - server->connect_time) / USEC, fmt);
+	USDT_PROBE3(server__close, server->id, pool->id, reason);
 
 	switch (server->state) {
 	case SV_ACTIVE:
+		if (server->mux_queue) {
+			mux_close_server(server, reason);
+			break;
+		}
 		client = server->link;
 		if (client) {
 			client->link = NULL;
@@ -725,14 +873,23 @@ void disconnect_server(PgSocket *server, bool notify, const char *reason, ...)
 	case SV_IDLE:
 		break;
 	case SV_LOGIN:
-		/*
-		 * usually disconnect means problems in startup phase,
-		 * except when sending cancel packet
-		 */
+		/* disconnect means problems in startup phase */
 		if (!server->ready)
-			pool->last_connect_failed = 1;
-		else
-			send_term = 0;
+			pool->last_connect_failed = pool->adapt_connect_failed = 1;
+		break;
+	case SV_CANCEL:
+		/* request that did not get through would be retried forever */
+		if (!server->ready) {
+			PgSocket *req = first_socket(&pool->cancel_req_list);
+			if (req)
+				disconnect_client(req, false, "cancel connect failed");
+		}
+		send_term = 0;
+		break;
+	case SV_LISTEN:
+		/* janitor launches new one if still needed */
+		if (!server->ready)
+			notify_listener_failed(pool);
 		break;
 	default:
 		fatal("disconnect_server: bad server state (%d)", server->state);
@@ -755,6 +912,7 @@ void disconnect_server(PgSocket *server, bool notify, const char *reason, ...)
 /* drop client connection */
 void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 {
+	const char *fmt = reason;
 	char buf[128];
 	va_list ap;
 	usec_t now = get_cached_time();
@@ -767,13 +925,30 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 	if (cf_log_disconnections)
 		slog_info(client, "closing because: %s (age=%llu)", reason,
 			  (now - client->connect_time) / USEC);
+	evlog_event(EVLOG_CLIENT_CLOSE, client, client->pool,
+		    (now - client->connect_time) / USEC, fmt);
+	USDT_PROBE3(client__close, client->id, USDT_POOL_ID(client), reason);
+
+	/* channels may need UNLISTEN */
+	notify_forget_client(client);
+
+	/* unfinished SHOW output */
+	admin_forget_client(client);
 
 	switch (client->state) {
 	case CL_ACTIVE:
-		if (client->link) {
+		if (client->muxed) {
+			/* server stays, answers will be skipped */
+			mux_forget_client(client);
+		} else if (client->link) {
 			PgSocket *server = client->link;
 			/* ->ready may be set before all is sent */
-			if (server->ready && sbuf_is_empty(&server->sbuf)) {
+			if (client->pin_flags && !*cf_server_reset_query) {
+				/* nothing would clean the session state */
+				server->link = NULL;
+				client->link = NULL;
+				disconnect_server(server, true, "pinned client closed");
+			} else if (server->ready && sbuf_is_empty(&server->sbuf)) {
 				/* retval does not matter here */
 				release_server(server);
 			} else {
@@ -799,19 +974,86 @@ void disconnect_client(PgSocket *client, bool notify, const char *reason, ...)
 		send_pooler_error(client, false, reason);
 	}
 
+	if (client->query_text) {
+		free(client->query_text);
+		client->query_text = NULL;
+	}
+
 	change_client_state(client, CL_JUSTFREE);
 	if (!sbuf_close(&client->sbuf))
 		log_noise("sbuf_close failed, retry later");
 }
 
-/* the pool needs new connection, if possible */
-void launch_new_connection(PgPool *pool)
+/*
+ * Start connecting new server socket in given state.  Returns false
+ * if socket could not be allocated, failed connect is handled later
+ * by disconnect_server().
+ */
+static bool connect_server(PgPool *pool, SocketState state)
 {
 	PgSocket *server;
-	int total;
 	const char *unix_dir = cf_unix_socket_dir;
 	bool res;
 
+	/* get free conn object */
+	server = obj_alloc(server_cache);
+	if (!server) {
+		log_debug("connect_server: no memory");
+		return false;
+	}
+
+	/* initialize it */
+	server->pool = pool;
+	server->auth_user = server->pool->user;
+	server->remote_addr = server->pool->db->addr;
+	server->connect_time = get_cached_time();
+	server->id = ++last_socket_id;
+	change_server_state(server, state);
+
+	evlog_event(EVLOG_SERVER_CONNECT, server, pool,
+		    state == SV_CANCEL ? EVLOG_CONN_CANCEL :
+		    state == SV_LISTEN ? EVLOG_CONN_LISTEN : EVLOG_CONN_NORMAL, NULL);
+
+	if (cf_log_connections)
+		slog_info(server, "new %sconnection to server",
+			  state == SV_CANCEL ? "cancel " :
+			  state == SV_LISTEN ? "listener " : "");
+
+	/* override socket location if requested */
+	if (server->pool->db->unix_socket_dir[0])
+		unix_dir = server->pool->db->unix_socket_dir;
+
+	/* start connecting */
+	res = sbuf_connect(&server->sbuf, &server->remote_addr, unix_dir,
+			   cf_server_connect_timeout / USEC);
+	if (!res)
+		log_noise("failed to launch new connection");
+	return true;
+}
+
+/*
+ * How many servers the pool should have.  With adaptive_pool_min
+ * the target moves between it and pool_size, see janitor.
+ */
+int pool_target_size(PgPool *pool)
+{
+	int max = pool->db->pool_size;
+	int min = cf_adaptive_pool_min;
+
+	if (min <= 0 || min >= max)
+		return max;
+	if (pool->target_size < min)
+		pool->target_size = min;
+	else if (pool->target_size > max)
+		pool->target_size = max;
+	return pool->target_size;
+}
+
+/* the pool needs new connection, if possible */
+void launch_new_connection(PgPool *pool)
+{
+	int total;
+
 	/* allow only small number of connection attempts at a time */
 	if (!statlist_empty(&pool->new_server_list)) {
 		log_debug("launch_new_connection: already progress");
@@ -829,7 +1071,7 @@ void launch_new_connection(PgPool *pool)
 
 	/* is it allowed to add servers? */
 	total = pool_server_count(pool);
-	if (total >= pool->db->pool_size && pool->welcome_msg_ready) {
+	if (total >= pool_target_size(pool) && pool->welcome_msg_ready) {
 		/* should we use reserve pool? */
 		if (cf_res_pool_timeout && pool->db->res_pool_size) {
 			usec_t now = get_cached_time();
@@ -842,38 +1084,44 @@ void launch_new_connection(PgPool *pool)
 			}
 		}
 		log_debug("launch_new_connection: pool full (%d >= %d)",
-				total, pool->db->pool_size);
+				total, pool_target_size(pool));
 		return;
 	}
 
 allow_new:
-	/* get free conn object */
-	server = obj_alloc(server_cache);
-	if (!server) {
-		log_debug("launch_new_connection: no memory");
-		return;
-	}
-
-	/* initialize it */
-	server->pool = pool;
-	server->auth_user = server->pool->user;
-	server->remote_addr = server->pool->db->addr;
-	server->connect_time = get_cached_time();
+	USDT_PROBE2(server__launch, pool->id, total);
 	pool->last_connect_time = get_cached_time();
-	change_server_state(server, SV_LOGIN);
-
-	if (cf_log_connections)
-		slog_info(server, "new connection to server");
+	connect_server(pool, SV_LOGIN);
+}
 
-	/* override socket location if requested */
-	if (server->pool->db->unix_socket_dir[0])
-		unix_dir = server->pool->db->unix_socket_dir;
+/*
+ * Cancel requests get their own connections, which are not
+ * counted in pool_size and do not wait for logins in progress.
+ */
+void launch_cancel_connection(PgPool *pool)
+{
+	int active;
+
+	while (1) {
+		active = statlist_count(&pool->cancel_server_list);
+		if (active >= statlist_count(&pool->cancel_req_list))
+			break;
+		if (active >= cf_max_cancel_conn) {
+			log_debug("launch_cancel_connection: limit reached (%d)", active);
+			break;
+		}
+		/* no memory, janitor retries later */
+		if (!connect_server(pool, SV_CANCEL))
+			break;
+	}
+}
 
-	/* start connecting */
-	res = sbuf_connect(&server->sbuf, &server->remote_addr, unix_dir,
-			   cf_server_connect_timeout / USEC);
-	if (!res)
-		log_noise("failed to launch new connection");
+/* one connection per pool LISTENs for all clients */
+void launch_listen_connection(PgPool *pool)
+{
+	if (!statlist_empty(&pool->listen_server_list))
+		return;
+	connect_server(pool, SV_LISTEN);
 }
 
 /* new client connection attempt */
@@ -894,11 +1142,17 @@ PgSocket * accept_client(int sock,
 
 	client->connect_time = client->request_time = get_cached_time();
 	client->query_start = 0;
+	client->id = ++last_socket_id;
 
 	fill_remote_addr(client, sock, is_unix);
 	fill_local_addr(client, sock, is_unix);
 
 	change_client_state(client, CL_LOGIN);
+	evlog_event(EVLOG_CLIENT_ACCEPT, client, NULL, 0, NULL);
+	USDT_PROBE3(client__accept, client->id, sock, is_unix);
+
+	/* results for slow client may be spooled */
+	client->sbuf.allow_spool = true;
 
 	res = sbuf_accept(&client->sbuf, sock, is_unix);
 	if (!res) {
@@ -917,6 +1171,8 @@ bool finish_client_login(PgSocket *client)
 	switch (client->state) {
 	case CL_LOGIN:
 		change_client_state(client, CL_ACTIVE);
+		evlog_event(EVLOG_CLIENT_LOGIN, client, client->pool,
+			    get_cached_time() - client->connect_time, NULL);
 	case CL_ACTIVE:
 		break;
 	default:
@@ -986,20 +1242,49 @@ found:
 		return;
 	}
 
+	/*
+	 * Multiplexed server may be running query of another client.
+	 * Even when this client's query is first, queries behind it are
+	 * already on server and one of them may be running by the time
+	 * the cancel arrives, so cancel only a lone query.
+	 */
+	server = main_client->link;
+	if (main_client->muxed && server->mux_count > 1) {
+		disconnect_client(req, false, "cancel request for multiplexed query");
+		return;
+	}
+
 	/* drop the connection, if fails, retry later in justfree list */
 	if (!sbuf_close(&req->sbuf))
 		log_noise("sbuf_close failed, retry later");
 
 	/* remember server key */
-	server = main_client->link;
 	memcpy(req->cancel_key, server->cancel_key, 8);
 
 	/* attach to target pool */
 	req->pool = pool;
 	change_client_state(req, CL_CANCEL);
 
-	/* need fresh connection */
-	launch_new_connection(pool);
+	/* send it via separate connection */
+	launch_cancel_connection(pool);
+}
+
+/* cancel query running on server, without client request */
+bool cancel_server_query(PgSocket *server)
+{
+	PgSocket *req;
+
+	req = obj_alloc(client_cache);
+	if (!req)
+		return false;
+
+	req->pool = server->pool;
+	req->connect_time = req->request_time = get_cached_time();
+	memcpy(req->cancel_key, server->cancel_key, BACKENDKEY_LEN);
+	change_client_state(req, CL_CANCEL);
+
+	launch_cancel_connection(server->pool);
+	return true;
 }
 
 void forward_cancel_request(PgSocket *server)
@@ -1008,7 +1293,7 @@ void forward_cancel_request(PgSocket *server)
 	PgSocket *req = first_socket(&server->pool->cancel_req_list);
 
 	Assert(req != NULL && req->state == CL_CANCEL);
-	Assert(server->state == SV_LOGIN);
+	Assert(server->state == SV_CANCEL);
 
 	SEND_CancelRequest(res, server, req->cancel_key);
 
@@ -1019,7 +1304,8 @@ bool use_client_socket(int fd, PgAddr *addr,
 		       const char *dbname, const char *username,
 		       uint64_t ckey, int oldfd, int linkfd,
 		       const char *client_enc, const char *std_string,
-		       const char *datestyle, const char *timezone)
+		       const char *datestyle, const char *timezone,
+		       PgSocket **sk_p)
 {
 	PgSocket *client;
 	PktBuf tmp;
@@ -1047,6 +1333,7 @@ bool use_client_socket(int fd, PgAddr *addr,
 	varcache_set(&client->vars, "datestyle", datestyle);
 	varcache_set(&client->vars, "timezone", timezone);
 
+	*sk_p = client;
 	return true;
 }
 
@@ -1054,7 +1341,8 @@ bool use_server_socket(int fd, PgAddr *addr,
 		       const char *dbname, const char *username,
 		       uint64_t ckey, int oldfd, int linkfd,
 		       const char *client_enc, const char *std_string,
-		       const char *datestyle, const char *timezone)
+		       const char *datestyle, const char *timezone,
+		       PgSocket **sk_p)
 {
 	PgDatabase *db = find_database(dbname);
 	PgUser *user;
@@ -1062,7 +1350,9 @@ bool use_server_socket(int fd, PgAddr *addr,
 	PgSocket *server;
 	PktBuf tmp;
 	bool res;
-	
+
+	*sk_p = NULL;
+
 	/* if the database not found, it's an auto database -> registering... */
 	if (!db) {
 		db = register_auto_database(dbname);
@@ -1092,6 +1382,7 @@ bool use_server_socket(int fd, PgAddr *addr,
 	server->auth_user = user;
 	server->connect_time = server->request_time = get_cached_time();
 	server->query_start = 0;
+	server->id = ++last_socket_id;
 
 	fill_remote_addr(server, fd, addr->is_unix);
 	fill_local_addr(server, fd, addr->is_unix);
@@ -1117,6 +1408,7 @@ bool use_server_socket(int fd, PgAddr *addr,
 	varcache_set(&server->vars, "datestyle", datestyle);
 	varcache_set(&server->vars, "timezone", timezone);
 
+	*sk_p = server;
 	return true;
 }
 
@@ -22,7 +22,7 @@
 
 #include "bouncer.h"
 
-static void pktbuf_free(PktBuf *buf)
+void pktbuf_free(PktBuf *buf)
 {
 	if (buf->fixed_buf)
 		return;
@@ -73,6 +73,9 @@ bool pktbuf_send_immidiate(PktBuf *buf, PgSocket *sk)
 
 	if (buf->failed)
 		return false;
+	/* must not overtake spooled data */
+	if (sbuf_has_spool(&sk->sbuf))
+		return sbuf_spool_append(&sk->sbuf, pos, amount);
 	res = safe_send(fd, pos, amount, 0);
 	if (res < 0) {
 		log_debug("pktbuf_send_immidiate: %s", strerror(errno));
@@ -80,13 +83,13 @@ bool pktbuf_send_immidiate(PktBuf *buf, PgSocket *sk)
 	return res == amount;
 }
 
-static void pktbuf_send_func(int fd, short flags, void *arg)
+static void pktbuf_send_func(int fd, short flags, void *arg);
+
+/* send what is possible, wait for socket to become writable for rest */
+static void pktbuf_try_send(PktBuf *buf, int fd)
 {
-	PktBuf *buf = arg;
 	int amount, res;
 
-	log_debug("pktbuf_send_func(%d, %d, %p)", fd, (int)flags, buf);
-
 	if (buf->failed)
 		return;
 
@@ -114,6 +117,16 @@ static void pktbuf_send_func(int fd, short flags, void *arg)
 		pktbuf_free(buf);
 }
 
+/* libevent EV_WRITE: socket is writable again */
+static void pktbuf_send_func(int fd, short flags, void *arg)
+{
+	PktBuf *buf = arg;
+
+	loop_callback(LOOP_SEND);
+	log_debug("pktbuf_send_func(%d, %d, %p)", fd, (int)flags, buf);
+	pktbuf_try_send(buf, fd);
+}
+
 bool pktbuf_send_queued(PktBuf *buf, PgSocket *sk)
 {
 	int fd = sbuf_socket(&sk->sbuf);
@@ -126,7 +139,7 @@ bool pktbuf_send_queued(PktBuf *buf, PgSocket *sk)
 		return send_pooler_error(sk, true, "result prepare failed");
 	} else {
 		buf->sending = 1;
-		pktbuf_send_func(fd, EV_WRITE, buf);
+		pktbuf_try_send(buf, fd);
 		return true;
 	}
 }
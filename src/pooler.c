@@ -207,6 +207,7 @@ static int create_net_socket(const char *listen_addr, int listen_port)
 
 static void err_wait_func(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_TIMER);
 	if (cf_pause_mode != P_SUSPEND)
 		resume_pooler();
 }
@@ -249,6 +250,8 @@ static void pool_accept(int sock, short flags, void *is_unix)
 	} addr;
 	socklen_t len = sizeof(addr);
 
+	loop_callback(LOOP_ACCEPT);
+
 	if(!(flags & EV_READ)) {
 		log_warning("No EV_READ in pool_accept");
 		return;
@@ -101,6 +101,13 @@ bool get_header(MBuf *data, PktHdr *pkt)
  */
 
 bool send_pooler_error(PgSocket *client, bool send_ready, const char *msg)
+{
+	return send_pooler_error_code(client, send_ready, "08P01", msg);
+}
+
+/* same, with specific SQLSTATE */
+bool send_pooler_error_code(PgSocket *client, bool send_ready,
+			    const char *code, const char *msg)
 {
 	uint8_t tmpbuf[512];
 	PktBuf buf;
@@ -110,7 +117,7 @@ bool send_pooler_error(PgSocket *client, bool send_ready, const char *msg)
 
 	pktbuf_static(&buf, tmpbuf, sizeof(tmpbuf));
 	pktbuf_write_generic(&buf, 'E', "cscscsc",
-			     'S', "ERROR", 'C', "08P01", 'M', msg, 0);
+			     'S', "ERROR", 'C', code, 'M', msg, 0);
 	if (send_ready)
 		pktbuf_write_ReadyForQuery(&buf);
 	return pktbuf_send_immidiate(&buf, client);
@@ -35,6 +35,29 @@
 #define ACT_SKIP 2
 #define ACT_CALL 3
 
+/*
+ * Data for slow socket.
+ *
+ * Kept in memory up to mem_limit, the rest goes to temp file
+ * up to file_limit.  Memory part is always sent before file part.
+ */
+struct SBufSpool {
+	struct event ev;	/* EV_WRITE on owner socket */
+	SBuf *waiter;		/* sbuf waiting for room in spool */
+
+	unsigned mem_limit;	/* max unsent bytes in mem */
+	off_t file_limit;	/* max unsent bytes in file */
+
+	uint8_t *mem;
+	unsigned mem_alloc;
+	unsigned mem_done;	/* sent from mem */
+	unsigned mem_used;	/* written to mem */
+
+	int fd;			/* spill file or -1 */
+	off_t file_done;
+	off_t file_used;
+};
+
 enum WaitType {
 	W_NONE = 0,
 	W_CONNECT,
@@ -56,14 +79,20 @@ static bool sbuf_queue_send(SBuf *sbuf) _MUSTCHECK;
 static bool sbuf_send_pending(SBuf *sbuf) _MUSTCHECK;
 static bool sbuf_process_pending(SBuf *sbuf) _MUSTCHECK;
 static void sbuf_connect_cb(int sock, short flags, void *arg);
+static void sbuf_connect_done(SBuf *sbuf, short flags);
 static void sbuf_recv_cb(int sock, short flags, void *arg);
 static void sbuf_send_cb(int sock, short flags, void *arg);
+static void sbuf_send_ready(SBuf *sbuf);
 static void sbuf_try_resync(SBuf *sbuf, bool release);
 static bool sbuf_wait_for_data(SBuf *sbuf) _MUSTCHECK;
 static void sbuf_main_loop(SBuf *sbuf, bool skip_recv);
 static bool sbuf_call_proto(SBuf *sbuf, int event) /* _MUSTCHECK */;
 static bool sbuf_actual_recv(SBuf *sbuf, unsigned len)  _MUSTCHECK;
 static bool sbuf_after_connect_check(SBuf *sbuf)  _MUSTCHECK;
+static bool sbuf_spool_start(SBuf *sbuf, unsigned mem_limit, off_t file_limit) _MUSTCHECK;
+static void sbuf_spool_free(SBuf *sbuf);
+static bool sbuf_wait_spool(SBuf *sbuf) _MUSTCHECK;
+static void sbuf_spool_cb(int sock, short flags, void *arg);
 
 static inline IOBuf *get_iobuf(SBuf *sbuf) { return sbuf->io; }
 
@@ -158,7 +187,7 @@ bool sbuf_connect(SBuf *sbuf, const PgAddr *addr, const char *unix_dir, int time
 	res = safe_connect(sock, sa, len);
 	if (res == 0) {
 		/* unix socket gives connection immidiately */
-		sbuf_connect_cb(sock, EV_WRITE, sbuf);
+		sbuf_connect_done(sbuf, EV_WRITE);
 		return true;
 	} else if (errno == EINPROGRESS) {
 		/* tcp socket needs waiting */
@@ -246,6 +275,86 @@ bool sbuf_continue_with_callback(SBuf *sbuf, sbuf_libevent_cb user_cb)
 	return true;
 }
 
+/*
+ * Can the socket state be handed over to another process?
+ *
+ * Besides buffered data, only packet position can be transferred.
+ * Data waiting to be sent must go to link, it is taken over too.
+ */
+bool sbuf_can_transfer(SBuf *sbuf, SBuf *link)
+{
+	bool sending;
+
+	if (sbuf->next_dst || sbuf->pkt_action == ACT_CALL)
+		return false;
+	if (sbuf->dst && sbuf->dst->spool)
+		return false;
+
+	sending = (sbuf->pkt_action == ACT_SEND && sbuf->pkt_remain > 0)
+		  || (sbuf->io && iobuf_amount_pending(sbuf->io) > 0);
+	if (sending)
+		return link != NULL && sbuf->dst == link;
+	return true;
+}
+
+/* stop all waiting on socket, buffered data stays as it is */
+bool sbuf_freeze(SBuf *sbuf)
+{
+	AssertActive(sbuf);
+
+	if (sbuf->wait_type == W_NONE)
+		return true;
+	Assert(sbuf->wait_type == W_RECV || sbuf->wait_type == W_SEND);
+
+	if (event_del(&sbuf->ev) < 0) {
+		log_warning("sbuf_freeze: event_del: %s", strerror(errno));
+		return false;
+	}
+	sbuf->wait_type = W_NONE;
+	return true;
+}
+
+/* unprocessed data in buffer, parse_ofs shows where parsing stopped */
+unsigned sbuf_get_buffered(SBuf *sbuf, const uint8_t **data_p, unsigned *parse_ofs_p)
+{
+	IOBuf *io = sbuf->io;
+
+	if (iobuf_empty(io)) {
+		*data_p = NULL;
+		*parse_ofs_p = 0;
+		return 0;
+	}
+	*data_p = io->buf + io->done_pos;
+	*parse_ofs_p = io->parse_pos - io->done_pos;
+	return io->recv_pos - io->done_pos;
+}
+
+/* load state from sbuf_get_buffered() and packet fields of old process */
+bool sbuf_restore(SBuf *sbuf, const uint8_t *data, unsigned len, unsigned parse_ofs,
+		  unsigned pkt_remain, uint8_t pkt_action)
+{
+	AssertActive(sbuf);
+	Assert(sbuf->io == NULL);
+
+	if (len > (unsigned)cf_sbuf_len || parse_ofs > len)
+		return false;
+	if (pkt_action > ACT_SKIP || (pkt_remain > 0 && pkt_action == ACT_UNSET))
+		return false;
+
+	if (len > 0) {
+		sbuf->io = obj_alloc(iobuf_cache);
+		if (sbuf->io == NULL)
+			return false;
+		iobuf_reset(sbuf->io);
+		memcpy(sbuf->io->buf, data, len);
+		sbuf->io->parse_pos = parse_ofs;
+		sbuf->io->recv_pos = len;
+	}
+	sbuf->pkt_remain = pkt_remain;
+	sbuf->pkt_action = pkt_action;
+	return true;
+}
+
 /* socket cleanup & close: keeps .handler and .arg values */
 bool sbuf_close(SBuf *sbuf)
 {
@@ -263,9 +372,14 @@ bool sbuf_close(SBuf *sbuf)
 			/* if (errno == ENOMEM) return false; */
 		}
 	}
+	if (sbuf->spool)
+		sbuf_spool_free(sbuf);
+	if (sbuf->dst && sbuf->dst->spool && sbuf->dst->spool->waiter == sbuf)
+		sbuf->dst->spool->waiter = NULL;
 	if (sbuf->sock > 0)
 		safe_close(sbuf->sock);
 	sbuf->dst = NULL;
+	sbuf->next_dst = NULL;
 	sbuf->sock = 0;
 	sbuf->pkt_remain = 0;
 	sbuf->pkt_action = sbuf->wait_type = 0;
@@ -286,7 +400,13 @@ void sbuf_prepare_send(SBuf *sbuf, SBuf *dst, unsigned amount)
 
 	sbuf->pkt_action = ACT_SEND;
 	sbuf->pkt_remain = amount;
-	sbuf->dst = dst;
+
+	/* data for previous target must go out first */
+	if (sbuf->dst && sbuf->dst != dst && sbuf->io
+	    && iobuf_amount_pending(sbuf->io) > 0)
+		sbuf->next_dst = dst;
+	else
+		sbuf->dst = dst;
 }
 
 /* proto_fn tells to skip some amount of bytes */
@@ -371,7 +491,13 @@ static bool sbuf_wait_for_data(SBuf *sbuf)
 /* libevent EV_WRITE: called when dest socket is writable again */
 static void sbuf_send_cb(int sock, short flags, void *arg)
 {
-	SBuf *sbuf = arg;
+	loop_callback(LOOP_SEND);
+	sbuf_send_ready(arg);
+}
+
+/* continue processing after dest socket became writable */
+static void sbuf_send_ready(SBuf *sbuf)
+{
 	bool res;
 
 	/* sbuf was closed before in this loop */
@@ -446,10 +572,23 @@ try_more:
 		return false;
 	}
 
+	/* if something is spooled already, new data must go after it */
+	if (sbuf->dst->spool) {
+		if (!sbuf_spool_append(sbuf->dst, io->buf + io->done_pos, avail))
+			return sbuf_wait_spool(sbuf);
+		io->done_pos += avail;
+		return true;
+	}
+
 	/* actually send it */
 	res = iobuf_send_pending(io, sbuf->dst->sock);
 	if (res < 0) {
 		if (errno == EAGAIN) {
+			/* slow reader, try to take the data off our hands */
+			if (sbuf->dst->allow_spool && cf_client_spool_size > 0
+			    && sbuf_spool_start(sbuf->dst, cf_client_spool_size,
+						cf_client_spool_file_size))
+				goto try_more;
 			if (!sbuf_queue_send(sbuf))
 				/* drop if queue failed */
 				sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
@@ -510,6 +649,17 @@ static bool sbuf_process_pending(SBuf *sbuf)
 			}
 		}
 
+		/* target changed, flush data for old one */
+		if (sbuf->next_dst) {
+			if (iobuf_amount_pending(io) > 0) {
+				res = sbuf_send_pending(sbuf);
+				if (!res)
+					return res;
+			}
+			sbuf->dst = sbuf->next_dst;
+			sbuf->next_dst = NULL;
+		}
+
 		if (avail > sbuf->pkt_remain)
 			avail = sbuf->pkt_remain;
 
@@ -579,6 +729,8 @@ static bool sbuf_actual_recv(SBuf *sbuf, unsigned len)
 static void sbuf_recv_cb(int sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
+
+	loop_callback(LOOP_RECV);
 	sbuf_main_loop(sbuf, DO_RECV);
 }
 
@@ -704,8 +856,13 @@ static bool sbuf_after_connect_check(SBuf *sbuf)
 /* callback for libevent EV_WRITE when connecting */
 static void sbuf_connect_cb(int sock, short flags, void *arg)
 {
-	SBuf *sbuf = arg;
+	loop_callback(LOOP_CONNECT);
+	sbuf_connect_done(arg, flags);
+}
 
+/* connect finished, EV_WRITE in flags if successfully */
+static void sbuf_connect_done(SBuf *sbuf, short flags)
+{
 	Assert(sbuf->wait_type == W_CONNECT || sbuf->wait_type == W_NONE);
 	sbuf->wait_type = W_NONE;
 
@@ -728,6 +885,8 @@ bool sbuf_answer(SBuf *sbuf, const void *buf, unsigned len)
 	int res;
 	if (sbuf->sock <= 0)
 		return false;
+	if (sbuf->spool)
+		return sbuf_spool_append(sbuf, buf, len);
 	res = safe_send(sbuf->sock, buf, len, 0);
 	if (res < 0) {
 		log_debug("sbuf_answer: error sending: %s", strerror(errno));
@@ -736,3 +895,242 @@ bool sbuf_answer(SBuf *sbuf, const void *buf, unsigned len)
 	return (unsigned)res == len;
 }
 
+
+/*
+ * Spooling.
+ *
+ * When client is slow to read, server data is moved to spool
+ * of client sbuf, so server can finish and be released.
+ */
+
+static bool spool_open_file(SBufSpool *sp)
+{
+	char fn[PATH_MAX];
+
+	snprintf(fn, sizeof(fn), "%s/pgbouncer-spool-XXXXXX", cf_client_spool_dir);
+	sp->fd = mkstemp(fn);
+	if (sp->fd < 0) {
+		log_warning("spool file: %s", strerror(errno));
+		return false;
+	}
+	unlink(fn);
+	fcntl(sp->fd, F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+/* add data after already spooled data */
+bool sbuf_spool_append(SBuf *sbuf, const void *data, unsigned len)
+{
+	SBufSpool *sp = sbuf->spool;
+	unsigned need;
+	int res;
+
+	Assert(sp);
+
+	/* memory, if file part is not in use */
+	if (sp->file_used == 0 && sp->mem_used - sp->mem_done + len <= sp->mem_limit) {
+		/* move unsent data to start, if new data does not fit after it */
+		if (sp->mem_done > 0 && sp->mem_used + len > sp->mem_alloc) {
+			memmove(sp->mem, sp->mem + sp->mem_done, sp->mem_used - sp->mem_done);
+			sp->mem_used -= sp->mem_done;
+			sp->mem_done = 0;
+		}
+		need = sp->mem_used + len;
+		if (need > sp->mem_alloc) {
+			unsigned alloc = sp->mem_alloc ? sp->mem_alloc : (unsigned)cf_sbuf_len * 4;
+			uint8_t *tmp;
+			while (alloc < need)
+				alloc *= 2;
+			if (alloc > sp->mem_limit)
+				alloc = sp->mem_limit;
+			tmp = realloc(sp->mem, alloc);
+			if (!tmp)
+				return false;
+			sp->mem = tmp;
+			sp->mem_alloc = alloc;
+		}
+		memcpy(sp->mem + sp->mem_used, data, len);
+		sp->mem_used += len;
+		return true;
+	}
+
+	/* spill to file, it is used until all of it is sent */
+	if (sp->file_used - sp->file_done + len > sp->file_limit)
+		return false;
+	if (sp->fd < 0 && !spool_open_file(sp))
+		return false;
+	while (len > 0) {
+		res = pwrite(sp->fd, data, len, sp->file_used);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			log_warning("spool file write: %s", strerror(errno));
+			return false;
+		}
+		data = (const uint8_t *)data + res;
+		len -= res;
+		sp->file_used += res;
+	}
+	return true;
+}
+
+/*
+ * Write data to sbuf's socket, spooling what does not fit.
+ * Keeps order with earlier data, so several sources can
+ * write whole packets to same socket.
+ */
+bool sbuf_write_ordered(SBuf *sbuf, const void *data, unsigned len, unsigned mem_limit)
+{
+	int res;
+
+	if (sbuf->spool)
+		return sbuf_spool_append(sbuf, data, len);
+
+	res = safe_send(sbuf->sock, data, len, 0);
+	if (res < 0) {
+		if (errno != EAGAIN)
+			return false;
+		res = 0;
+	}
+	if ((unsigned)res == len)
+		return true;
+
+	if (!sbuf_spool_start(sbuf, mem_limit, 0))
+		return false;
+	return sbuf_spool_append(sbuf, (const uint8_t *)data + res, len - res);
+}
+
+/* start spooling on sbuf, it takes over writing to the socket */
+static bool sbuf_spool_start(SBuf *sbuf, unsigned mem_limit, off_t file_limit)
+{
+	SBufSpool *sp;
+
+	Assert(!sbuf->spool);
+
+	sp = zmalloc(sizeof(*sp));
+	if (!sp)
+		return false;
+	sp->fd = -1;
+	sp->mem_limit = mem_limit;
+	sp->file_limit = file_limit;
+
+	event_set(&sp->ev, sbuf->sock, EV_WRITE, sbuf_spool_cb, sbuf);
+	if (event_add(&sp->ev, NULL) < 0) {
+		log_warning("sbuf_spool_start: event_add failed: %s", strerror(errno));
+		free(sp);
+		return false;
+	}
+	sbuf->spool = sp;
+	log_noise("spool started on fd %d", sbuf->sock);
+	return true;
+}
+
+static void sbuf_spool_free(SBuf *sbuf)
+{
+	SBufSpool *sp = sbuf->spool;
+
+	event_del(&sp->ev);
+	if (sp->fd >= 0)
+		safe_close(sp->fd);
+	free(sp->mem);
+	free(sp);
+	sbuf->spool = NULL;
+}
+
+/* spool is full, stop reading until it is sent */
+static bool sbuf_wait_spool(SBuf *sbuf)
+{
+	AssertActive(sbuf);
+	Assert(sbuf->wait_type == W_RECV);
+
+	if (event_del(&sbuf->ev) < 0) {
+		log_warning("sbuf_wait_spool: event_del failed: %s", strerror(errno));
+		sbuf->wait_type = W_NONE;
+		sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
+		return false;
+	}
+	sbuf->wait_type = W_SEND;
+	sbuf->dst->spool->waiter = sbuf;
+	return false;
+}
+
+/* has enough been sent to let waiting writer continue */
+static bool spool_has_room(SBufSpool *sp)
+{
+	if (sp->file_used > 0)
+		return sp->file_used - sp->file_done <= sp->file_limit / 2;
+	return sp->mem_used - sp->mem_done <= sp->mem_limit / 2;
+}
+
+/* libevent EV_WRITE: send spooled data */
+static void sbuf_spool_cb(int sock, short flags, void *arg)
+{
+	SBuf *sbuf = arg;
+	SBufSpool *sp = sbuf->spool;
+	SBuf *waiter;
+	uint8_t buf[8192];
+	const uint8_t *data;
+	int len, res;
+	bool from_file;
+
+	loop_callback(LOOP_SEND);
+
+	while (1) {
+		if (sp->mem_done < sp->mem_used) {
+			data = sp->mem + sp->mem_done;
+			len = sp->mem_used - sp->mem_done;
+			from_file = false;
+		} else if (sp->file_done < sp->file_used) {
+			len = sp->file_used - sp->file_done;
+			if (len > (int)sizeof(buf))
+				len = sizeof(buf);
+			len = pread(sp->fd, buf, len, sp->file_done);
+			if (len <= 0) {
+				log_warning("spool file read: %s", strerror(errno));
+				goto failed;
+			}
+			data = buf;
+			from_file = true;
+		} else
+			break;
+
+		res = safe_send(sock, data, len, 0);
+		if (res < 0) {
+			if (errno != EAGAIN)
+				goto failed;
+			if (event_add(&sp->ev, NULL) < 0)
+				goto failed;
+
+			/* writer may continue before all is sent, spool is consistent here */
+			waiter = sp->waiter;
+			if (waiter && spool_has_room(sp)) {
+				sp->waiter = NULL;
+				sbuf_send_ready(waiter);
+			}
+			return;
+		}
+
+		if (from_file) {
+			sp->file_done += res;
+			/* rewind, new data can go to mem again */
+			if (sp->file_done == sp->file_used)
+				sp->file_done = sp->file_used = 0;
+		} else {
+			sp->mem_done += res;
+			if (sp->mem_done == sp->mem_used)
+				sp->mem_done = sp->mem_used = 0;
+		}
+	}
+
+	/* all sent, give socket back to normal processing */
+	log_noise("spool done on fd %d", sock);
+	waiter = sp->waiter;
+	sbuf_spool_free(sbuf);
+	if (waiter)
+		sbuf_send_ready(waiter);
+	return;
+
+failed:
+	sbuf_spool_free(sbuf);
+	sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+}
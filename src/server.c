@@ -44,7 +44,8 @@ static bool load_parameter(PgSocket *server, PktHdr *pkt, bool startup)
 
 	varcache_set(&server->vars, key, val);
 
-	if (client) {
+	/* reset query reports apply to server only */
+	if (client && !server->resetting) {
 		slog_debug(client, "setting client var: %s='%s'", key, val);
 		varcache_set(&client->vars, key, val);
 	}
@@ -144,10 +145,18 @@ static bool handle_server_startup(PgSocket *server, PktHdr *pkt)
 		/* login ok */
 		slog_debug(server, "server login ok, start accepting queries");
 		server->ready = 1;
+		evlog_event(EVLOG_SERVER_LOGIN, server, server->pool,
+			    get_cached_time() - server->connect_time, NULL);
 
 		/* got all params */
 		finish_welcome_msg(server);
 
+		/* listener stays out of pool */
+		if (server->state == SV_LISTEN) {
+			res = notify_server_ready(server);
+			break;
+		}
+
 		/* need to notify sbuf if server was closed */
 		res = release_server(server);
 
@@ -201,6 +210,17 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 			return false;
 		state = mbuf_get_char(&pkt->data);
 
+		/*
+		 * Query is over, canceled or not.  Inside transaction server
+		 * stays linked, so query_timeout must count from now, not from
+		 * the canceled query, or janitor would cancel again.
+		 */
+		if (server->timeout_cancel) {
+			server->timeout_cancel = 0;
+			if (client)
+				client->request_time = get_cached_time();
+		}
+
 		/* set ready only if no tx */
 		if (state == 'I')
 			ready = 1;
@@ -226,7 +246,10 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 	 * it later.
 	 */
 	case 'E':		/* ErrorResponse */
-		if (server->setting_vars) {
+		if (server->resetting) {
+			/* same as for non-pipelined reset, just log it */
+			log_server_error("server_reset_query failed", pkt);
+		} else if (server->setting_vars) {
 			/*
 			 * the SET and user query will be different TX
 			 * so we cannot report SET error to user.
@@ -267,18 +290,65 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 	case 'T':		/* RowDescription */
 		break;
 	}
-	server->ready = ready;
 	server->pool->stats.server_bytes += pkt->len;
 
-	if (server->setting_vars) {
-		Assert(client);
+	/*
+	 * Answer to pipelined reset query or SET.  Client query is
+	 * already sent, so ->ready must stay as-is.  Reset query
+	 * is always sent before SET, so its answer comes first.
+	 */
+	if (server->resetting || server->setting_vars) {
+		if (pkt->type == 'Z') {
+			if (server->resetting)
+				server->resetting = 0;
+			else
+				server->setting_vars = 0;
+		}
 		sbuf_prepare_skip(sbuf, pkt->len);
-	} else if (client) {
+		return true;
+	}
+
+	if (client && client->digest_hash) {
+		client->digest_bytes += pkt->len;
+		/* each statement of transaction is counted separately */
+		if (pkt->type == 'Z' && !server->mux_queue)
+			digest_query_done(client);
+	}
+
+	if (server->mux_queue)
+		return mux_server_packet(server, pkt, ready);
+
+	server->ready = ready;
+
+	if (client) {
 		sbuf_prepare_send(sbuf, &client->sbuf, pkt->len);
+		if (pkt->type == 'Z' && server->query_start) {
+			/*
+			 * Time spent in server for this statement, without
+			 * waiting in pooler or for client between statements
+			 * of a transaction.
+			 */
+			PgPool *pool = server->pool;
+			usec_t now = get_cached_time();
+			usec_t t = now - server->query_start;
+			pool->adapt_query_time += t;
+			pool->adapt_query_count++;
+			if (pool->service_time)
+				pool->service_time = (pool->service_time * 7 + t) / 8;
+			else
+				pool->service_time = t;
+			server->query_start = 0;
+			USDT_PROBE4(query__done, client->id, server->id,
+				    client->query_start ? now - client->query_start : 0, t);
+		}
 		if (ready && client->query_start) {
 			usec_t total;
 			total = get_cached_time() - client->query_start;
+			if (cf_log_slow_queries > 0 && total >= (usec_t)cf_log_slow_queries * 1000)
+				log_slow_query(client, total, client->link_time > client->query_start
+					       ? client->link_time - client->query_start : 0);
 			client->query_start = 0;
+			client->link_time = 0;
 			server->pool->stats.query_time += total;
 			slog_debug(client, "query time: %d us", (int)total);
 		} else if (ready) {
@@ -303,10 +373,10 @@ static bool handle_connect(PgSocket *server)
 
 	fill_local_addr(server, sbuf_socket(&server->sbuf), server->remote_addr.is_unix);
 
-	if (!statlist_empty(&pool->cancel_req_list)) {
-		slog_debug(server, "use it for pending cancel req");
-		/* if pending cancel req, send it */
-		forward_cancel_request(server);
+	if (server->state == SV_CANCEL) {
+		/* request may be gone if other connection was faster */
+		if (!statlist_empty(&pool->cancel_req_list))
+			forward_cancel_request(server);
 		/* notify disconnect_server() that connect did not fail */
 		server->ready = 1;
 		disconnect_server(server, false, "sent cancel req");
@@ -359,6 +429,12 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, MBuf *data)
 		case SV_LOGIN:
 			res = handle_server_startup(server, &pkt);
 			break;
+		case SV_LISTEN:
+			if (server->ready)
+				res = notify_server_packet(server, &pkt);
+			else
+				res = handle_server_startup(server, &pkt);
+			break;
 		case SV_TESTED:
 		case SV_USED:
 		case SV_ACTIVE:
@@ -370,29 +446,26 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, MBuf *data)
 		}
 		break;
 	case SBUF_EV_CONNECT_FAILED:
-		Assert(server->state == SV_LOGIN);
+		Assert(server->state == SV_LOGIN || server->state == SV_CANCEL
+		       || server->state == SV_LISTEN);
 		disconnect_server(server, false, "connect failed");
 		break;
 	case SBUF_EV_CONNECT_OK:
 		slog_debug(server, "S: connect ok");
-		Assert(server->state == SV_LOGIN);
+		Assert(server->state == SV_LOGIN || server->state == SV_CANCEL
+		       || server->state == SV_LISTEN);
 		server->request_time = get_cached_time();
 		res = handle_connect(server);
 		break;
 	case SBUF_EV_FLUSH:
 		res = true;
-		if (!server->ready)
+		if (!server->ready || server->state == SV_LISTEN)
 			break;
 
-		if (server->setting_vars) {
-			PgSocket *client = server->link;
-			Assert(client);
-
-			server->setting_vars = 0;
-			sbuf_continue(&client->sbuf);
+		/* client with session state keeps the server */
+		if (server->link && server->link->pin_flags)
 			break;
-		}
-		
+
 		if (cf_pool_mode  != POOL_SESSION || server->state == SV_TESTED) {
 			switch (server->state) {
 			case SV_ACTIVE:
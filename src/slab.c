@@ -21,6 +21,19 @@
  *
  * - On each alloc initializer is called.
  * - if init func is not given, memset() is done
+ *
+ * Each slab keeps its own freelist.  Allocation takes from the oldest
+ * slab that has free objects, so objects pack into old slabs and newest
+ * ones drain after load spike.  Age is fill order, not address: malloc
+ * hands out big blocks with mmap, which may map them top-down.  Slab that has
+ * stayed empty long enough gives its pages back to OS, but keeps
+ * its address range, so stale pointers stay readable and the slab
+ * is reused on next grow.
+ *
+ * Caches created with OBJCACHE_ARENA take their slabs from few large
+ * mmap regions, backed by huge pages if system has them, so hot
+ * connection state sits on few TLB entries.  Arena slabs are not
+ * reclaimed.
  */
 
 #include "bouncer.h"
@@ -33,16 +46,26 @@
 #define ALIGN(x)  CUSTOM_ALIGN(x, sizeof(long))
 #endif
 
+/* arena regions are multiple of usual huge page size */
+#define ARENA_PAGE	(2*1024*1024)
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 /*
  * Store for pre-initialized objects of one type.
  */
 struct ObjectCache {
 	List head;
-	StatList freelist;
-	StatList slablist;
+	StatList slablist;	/* all slabs, in address order */
+	StatList partial;	/* resident slabs with free objects, oldest first */
 	char name[32];
 	unsigned final_size;
-	unsigned total_count;
+	unsigned total_count;	/* objects in resident slabs */
+	unsigned free_count;	/* free objects in resident slabs */
+	unsigned fill_seq;	/* last Slab.seq given out */
+	int flags;		/* OBJCACHE_* */
 	obj_init_fn  init_func;
 };
 
@@ -51,26 +74,48 @@ struct ObjectCache {
  */
 struct Slab {
 	List head;
+	List partial_head;
+	StatList freelist;
+	unsigned count;		/* objects in slab */
+	unsigned seq;		/* fill order, older slabs have lower */
+	usec_t empty_since;	/* when all objects became free */
+	bool dormant;		/* pages are given back to OS */
 };
 
+/* objects start on cache line boundary */
+#define slab_area(slab) ((char *)CUSTOM_ALIGN((char *)(slab) + sizeof(struct Slab), CACHELINE_SIZE))
+#define SLAB_HDR_SIZE	(sizeof(struct Slab) + CACHELINE_SIZE - 1)
+#define slab_unused(slab) ((unsigned)statlist_count(&(slab)->freelist) == (slab)->count)
+
 /* keep track of all caches */
 static STATLIST(objcache_list);
 
 /* cache for cache headers */
 static ObjectCache *objcache_cache = NULL;
 
+/* unused part of current arena region */
+static char *arena_pos;
+static size_t arena_left;
+
+/* MAP_HUGETLB failed once, do not retry */
+static bool arena_no_hugetlb;
+
 /* fill struct contents */
 static void init_objcache(ObjectCache *cache,
 			  const char *name,
 			  unsigned obj_size,
 			  unsigned align,
-			  obj_init_fn init_func)
+			  obj_init_fn init_func,
+			  int flags)
 {
 	list_init(&cache->head);
-	statlist_init(&cache->freelist, name);
 	statlist_init(&cache->slablist, name);
+	statlist_init(&cache->partial, name);
 	safe_strcpy(cache->name, name, sizeof(cache->name));
 	cache->total_count = 0;
+	cache->free_count = 0;
+	cache->fill_seq = 0;
+	cache->flags = flags;
 	cache->init_func = init_func;
 	statlist_append(&cache->head, &objcache_list);
 
@@ -86,7 +131,8 @@ static void init_objcache(ObjectCache *cache,
 ObjectCache * objcache_create(const char *name,
 			      unsigned obj_size,
 			      unsigned align,
-			      obj_init_fn init_func)
+			      obj_init_fn init_func,
+			      int flags)
 {
 	ObjectCache *cache;
 
@@ -96,13 +142,13 @@ ObjectCache * objcache_create(const char *name,
 		if (!objcache_cache)
 			return NULL;
 		init_objcache(objcache_cache, "objcache_cache",
-			      sizeof(ObjectCache), 0, NULL);
+			      sizeof(ObjectCache), 0, NULL, 0);
 	}
 
 	/* new cache object */
 	cache = obj_alloc(objcache_cache);
 	if (cache)
-		init_objcache(cache, name, obj_size, align, init_func);
+		init_objcache(cache, name, obj_size, align, init_func, flags);
 	return cache;
 }
 
@@ -114,19 +160,131 @@ void objcache_destroy(ObjectCache *cache)
 
 	statlist_for_each_safe(item, &cache->slablist, tmp) {
 		slab = container_of(item, struct Slab, head);
-		free(slab);
+		/* arena memory is never given back */
+		if (!(cache->flags & OBJCACHE_ARENA))
+			free(slab);
 	}
 	statlist_remove(&cache->head, &objcache_list);
 	memset(cache, 0, sizeof(*cache));
 	obj_free(objcache_cache, cache);
 }
 
-/* add new block of objects to cache */
-static void grow(ObjectCache *cache)
+/* map new arena region, huge pages if possible */
+static void *arena_map(size_t size)
 {
-	unsigned count, i, size;
-	char *area;
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	char *p;
+	size_t extra;
+
+#ifdef MAP_HUGETLB
+	if (!arena_no_hugetlb) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+		log_info("arena: no huge pages (%s), using normal pages", strerror(errno));
+		arena_no_hugetlb = true;
+	}
+#endif
+
+	/* align to huge page, so kernel can use transparent huge pages */
+	p = mmap(NULL, size + ARENA_PAGE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		log_warning("arena: mmap: %s", strerror(errno));
+		return NULL;
+	}
+	extra = CUSTOM_ALIGN(p, ARENA_PAGE) - (unsigned long)p;
+	if (extra > 0)
+		munmap(p, extra);
+	munmap(p + extra + size, ARENA_PAGE - extra);
+	p += extra;
+#ifdef MADV_HUGEPAGE
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return p;
+#else
+	return malloc(size);
+#endif
+}
+
+/* carve slab memory from arena */
+static void *arena_alloc(size_t size)
+{
+	size_t region;
+	char *p;
+
+	size = CUSTOM_ALIGN(size, CACHELINE_SIZE);
+	if (size > arena_left) {
+		region = CUSTOM_ALIGN(size, ARENA_PAGE);
+		p = arena_map(region);
+		if (!p)
+			return NULL;
+		log_debug("arena: new region of %lu bytes", (unsigned long)region);
+		arena_pos = p;
+		arena_left = region;
+	}
+	p = arena_pos;
+	arena_pos += size;
+	arena_left -= size;
+	return p;
+}
+
+/* insert slab into list, slablist in address order, partial in age order */
+static void slab_list_insert(StatList *list, List *node, struct Slab *slab, bool partial)
+{
+	List *item;
+	struct Slab *cur;
+
+	statlist_for_each(item, list) {
+		if (partial)
+			cur = container_of(item, struct Slab, partial_head);
+		else
+			cur = container_of(item, struct Slab, head);
+		if (partial ? cur->seq > slab->seq : cur > slab) {
+			statlist_put_before(node, list, item);
+			return;
+		}
+	}
+	statlist_append(node, list);
+}
+
+/* put all objects of slab to its freelist */
+static void fill_slab(ObjectCache *cache, struct Slab *slab)
+{
+	char *area = slab_area(slab);
+	unsigned i;
+
+	statlist_init(&slab->freelist, cache->name);
+	for (i = 0; i < slab->count; i++) {
+		List *head = (List *)(area + i * cache->final_size);
+		list_init(head);
+		statlist_append(head, &slab->freelist);
+	}
+	slab->empty_since = get_cached_time();
+	slab->dormant = false;
+	/* revived dormant slab counts as newest */
+	slab->seq = ++cache->fill_seq;
+
+	cache->total_count += slab->count;
+	cache->free_count += slab->count;
+	slab_list_insert(&cache->partial, &slab->partial_head, slab, true);
+}
+
+/* add new block of objects to cache, reusing dormant slab if possible */
+static struct Slab *grow(ObjectCache *cache)
+{
+	unsigned count, size;
 	struct Slab *slab;
+	List *item;
+
+	statlist_for_each(item, &cache->slablist) {
+		slab = container_of(item, struct Slab, head);
+		if (slab->dormant) {
+			fill_slab(cache, slab);
+			return slab;
+		}
+	}
 
 	/* calc new slab size */
 	count = cache->total_count;
@@ -137,49 +295,125 @@ static void grow(ObjectCache *cache)
 	size = count * cache->final_size;
 
 	/* allocate & init */
-	slab = malloc(size + sizeof(struct Slab));
+	if (cache->flags & OBJCACHE_ARENA)
+		slab = arena_alloc(size + SLAB_HDR_SIZE);
+	else
+		slab = malloc(size + SLAB_HDR_SIZE);
 	if (!slab)
-		return;
+		return NULL;
 	list_init(&slab->head);
-	area = (char *)slab + sizeof(struct Slab);
-	memset(area, 0, size);
-
-	/* init objects */
-	for (i = 0; i < count; i++) {
-		void *obj = area + i * cache->final_size;
-		List *head = (List *)obj;
-		list_init(head);
-		statlist_append(head, &cache->freelist);
-	}
+	list_init(&slab->partial_head);
+	memset(slab_area(slab), 0, size);
+	slab->count = count;
 
 	/* register to cache */
-	cache->total_count += count;
-	statlist_append(&slab->head, &cache->slablist);
+	slab_list_insert(&cache->slablist, &slab->head, slab, false);
+	fill_slab(cache, slab);
+	return slab;
+}
+
+/* find slab the object belongs to */
+static struct Slab *find_slab(ObjectCache *cache, void *obj)
+{
+	List *item;
+	struct Slab *slab;
+	char *area;
+
+	statlist_for_each(item, &cache->slablist) {
+		slab = container_of(item, struct Slab, head);
+		area = slab_area(slab);
+		if ((char *)obj < area)
+			break;
+		if ((char *)obj < area + slab->count * cache->final_size)
+			return slab;
+	}
+	fatal("obj_free: object %p not from cache %s", obj, cache->name);
+	return NULL;
 }
 
 /* get free object from cache */
 void *obj_alloc(ObjectCache *cache)
 {
-	List *item = statlist_pop(&cache->freelist);
-	if (!item) {
-		grow(cache);
-		item = statlist_pop(&cache->freelist);
-	}
-	if (item) {
-		if (cache->init_func)
-			cache->init_func(item);
-		else
-			memset(item, 0, cache->final_size);
-	}
+	struct Slab *slab;
+	List *item;
+
+	item = statlist_first(&cache->partial);
+	if (item)
+		slab = container_of(item, struct Slab, partial_head);
+	else
+		slab = grow(cache);
+	if (!slab)
+		return NULL;
+
+	item = statlist_pop(&slab->freelist);
+	cache->free_count--;
+	if (statlist_count(&slab->freelist) == 0)
+		statlist_remove(&slab->partial_head, &cache->partial);
+
+	if (cache->init_func)
+		cache->init_func(item);
+	else
+		memset(item, 0, cache->final_size);
 	return item;
 }
 
 /* put object back to cache */
 void obj_free(ObjectCache *cache, void *obj)
 {
+	struct Slab *slab = find_slab(cache, obj);
 	List *item = obj;
+
 	list_init(item);
-	statlist_prepend(item, &cache->freelist);
+	statlist_prepend(item, &slab->freelist);
+	cache->free_count++;
+
+	if (statlist_count(&slab->freelist) == 1)
+		slab_list_insert(&cache->partial, &slab->partial_head, slab, true);
+	if (slab_unused(slab))
+		slab->empty_since = get_cached_time();
+}
+
+/* give pages of empty slab back to OS, but keep them mapped: see admin.c */
+static void release_slab(ObjectCache *cache, struct Slab *slab)
+{
+#if defined(HAVE_MADVISE) && defined(MADV_DONTNEED)
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long start, end;
+
+	start = CUSTOM_ALIGN(slab_area(slab), page);
+	end = ((unsigned long)slab_area(slab) + slab->count * cache->final_size) & ~(page - 1);
+	if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) < 0) {
+		log_warning("madvise: %s", strerror(errno));
+		return;
+	}
+#endif
+	statlist_remove(&slab->partial_head, &cache->partial);
+	statlist_init(&slab->freelist, cache->name);
+	slab->dormant = true;
+	cache->total_count -= slab->count;
+	cache->free_count -= slab->count;
+	log_debug("%s: released slab of %u objects", cache->name, slab->count);
+}
+
+/* release slabs that have been empty for at least min_age */
+void objcache_reclaim(usec_t min_age)
+{
+	usec_t now = get_cached_time();
+	ObjectCache *cache;
+	struct Slab *slab;
+	List *item, *sitem;
+
+	statlist_for_each(item, &objcache_list) {
+		cache = container_of(item, ObjectCache, head);
+		if (cache->flags & OBJCACHE_ARENA)
+			continue;
+		statlist_for_each(sitem, &cache->slablist) {
+			slab = container_of(sitem, struct Slab, head);
+			if (!slab->dormant && slab_unused(slab)
+			    && now - slab->empty_since >= min_age)
+				release_slab(cache, slab);
+		}
+	}
 }
 
 /* total number of objects allocated from cache */
@@ -191,7 +425,7 @@ int objcache_total_count(const ObjectCache *cache)
 /* free objects in cache */
 int objcache_free_count(const ObjectCache *cache)
 {
-	return statlist_count(&cache->freelist);
+	return cache->free_count;
 }
 
 /* number of objects in use */
@@ -200,10 +434,27 @@ int objcache_active_count(const ObjectCache *cache)
 	return objcache_total_count(cache) - objcache_free_count(cache);
 }
 
+/* objects in resident slabs that have nothing in use */
+static unsigned reclaimable_count(ObjectCache *cache)
+{
+	List *item;
+	struct Slab *slab;
+	unsigned count = 0;
+
+	if (cache->flags & OBJCACHE_ARENA)
+		return 0;
+	statlist_for_each(item, &cache->slablist) {
+		slab = container_of(item, struct Slab, head);
+		if (!slab->dormant && slab_unused(slab))
+			count += slab->count;
+	}
+	return count;
+}
+
 static void run_slab_stats(ObjectCache *cache, slab_stat_fn fn, void *arg)
 {
-	unsigned free = statlist_count(&cache->freelist);
-	fn(arg, cache->name, cache->final_size, free, cache->total_count);
+	fn(arg, cache->name, cache->final_size, cache->free_count,
+	   cache->total_count, reclaimable_count(cache));
 }
 
 void objcache_stats(slab_stat_fn fn, void *arg)
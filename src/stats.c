@@ -172,6 +172,8 @@ static void refresh_stats(int s, short flags, void *arg)
 	struct timeval period = { cf_stats_period, 0 };
 	PgStats old_total, cur_total, avg;
 
+	loop_callback(LOOP_TIMER);
+
 	reset_stats(&old_total);
 	reset_stats(&cur_total);
 
@@ -21,6 +21,12 @@
  * and continue with them.
  *
  * Each row from SHOW FDS will have corresponding fd in ancillary message.
+ * SHOW FDS_BINARY packs up to TAKEOVER_MAX_FDS sockets into one row,
+ * with all their fds in one message.  If old process does not know it,
+ * SHOW FDS is used.
+ *
+ * SUSPEND BUFFERS lets old process suspend sockets that still have
+ * data buffered, the data comes along in SHOW FDS_BINARY rows.
  *
  * Manpages: unix, sendmsg, recvmsg, cmsg, readv
  */
@@ -34,6 +40,20 @@
 
 static PgSocket *old_bouncer = NULL;
 
+/* data from old process, may end with partial packet */
+static uint8_t *recv_data;
+static unsigned recv_len, recv_alloc;
+
+/* fds received, but not yet used */
+static int *recv_fds;
+static unsigned recv_fd_pos, recv_fd_count, recv_fd_alloc;
+
+/* SUSPEND BUFFERS was sent, but not answered yet */
+static bool suspend_buffers;
+
+/* SHOW FDS_BINARY was sent */
+static bool binary_fds;
+
 void takeover_finish(void)
 {
 	uint8_t buf[512];
@@ -74,8 +94,51 @@ static void takeover_finish_part1(PgSocket *bouncer)
 	log_info("disko over, going background");
 }
 
-/* parse msg for fd and info */
-static void takeover_load_fd(MBuf *pkt, const struct cmsghdr *cmsg)
+/* take over socket from old process, returns client or server socket */
+static PgSocket *takeover_use_fd(int fd, const char *task, PgAddr *addr,
+				 const char *user, const char *db,
+				 uint64_t ckey, int oldfd, int linkfd,
+				 const char *client_enc, const char *std_string,
+				 const char *datestyle, const char *timezone)
+{
+	PgSocket *sk = NULL;
+	bool res = false;
+
+	log_debug("FD row: fd=%d(%d) linkfd=%d task=%s user=%s db=%s enc=%s",
+		  oldfd, fd, linkfd, task,
+		  user ? user : "NULL", db ? db : "NULL",
+		  client_enc ? client_enc : "NULL");
+
+	if (addr->is_unix)
+		addr->port = cf_listen_port;
+
+	/* decide what to do with it */
+	if (strcmp(task, "client") == 0)
+		res = use_client_socket(fd, addr, db, user, ckey, oldfd, linkfd,
+				  client_enc, std_string, datestyle, timezone, &sk);
+	else if (strcmp(task, "server") == 0)
+		res = use_server_socket(fd, addr, db, user, ckey, oldfd, linkfd,
+				  client_enc, std_string, datestyle, timezone, &sk);
+	else if (strcmp(task, "pooler") == 0)
+		res = use_pooler_socket(fd, addr->is_unix);
+	else
+		fatal("unknown task: %s", task);
+
+	if (!res)
+		fatal("socket takeover failed - no mem?");
+	return sk;
+}
+
+/* next fd from ancillary data */
+static int takeover_next_fd(void)
+{
+	if (recv_fd_pos >= recv_fd_count)
+		fatal("got row without fd info");
+	return recv_fds[recv_fd_pos++];
+}
+
+/* parse SHOW FDS row */
+static void takeover_load_fd(MBuf *pkt)
 {
 	int fd;
 	char *task, *saddr, *user, *db;
@@ -84,19 +147,11 @@ static void takeover_load_fd(MBuf *pkt, const struct cmsghdr *cmsg)
 	int got;
 	uint64_t ckey;
 	PgAddr addr;
-	bool res = false;
 
 	memset(&addr, 0, sizeof(addr));
 
-	if (cmsg->cmsg_level == SOL_SOCKET
-		&& cmsg->cmsg_type == SCM_RIGHTS
-		&& cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
-	{
-		/* get the fd */
-		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
-		log_debug("got fd: %d", fd);
-	} else
-		fatal("broken fd packet");
+	fd = takeover_next_fd();
+	log_debug("got fd: %d", fd);
 
 	/* parse row contents */
 	got = scan_text_result(pkt, "issssiqissss", &oldfd, &task, &user, &db,
@@ -105,34 +160,99 @@ static void takeover_load_fd(MBuf *pkt, const struct cmsghdr *cmsg)
 	if (task == NULL || saddr == NULL)
 		fatal("NULL data from old process");
 
-	log_debug("FD row: fd=%d(%d) linkfd=%d task=%s user=%s db=%s enc=%s",
-		  oldfd, fd, linkfd, task,
-		  user ? user : "NULL", db ? db : "NULL",
-		  client_enc ? client_enc : "NULL");
-
 	/* fill address */
 	addr.is_unix = strcmp(saddr, "unix") == 0 ? true : false;
-	if (addr.is_unix) {
-		addr.port = cf_listen_port;
-	} else {
+	if (!addr.is_unix) {
 		addr.ip_addr.s_addr = inet_addr(saddr);
 		addr.port = port;
 	}
 
-	/* decide what to do with it */
-	if (strcmp(task, "client") == 0)
-		res = use_client_socket(fd, &addr, db, user, ckey, oldfd, linkfd,
-				  client_enc, std_string, datestyle, timezone);
-	else if (strcmp(task, "server") == 0)
-		res = use_server_socket(fd, &addr, db, user, ckey, oldfd, linkfd,
-				  client_enc, std_string, datestyle, timezone);
-	else if (strcmp(task, "pooler") == 0)
-		res = use_pooler_socket(fd, addr.is_unix);
-	else
-		fatal("unknown task: %s", task);
+	takeover_use_fd(fd, task, &addr, user, db, ckey, oldfd, linkfd,
+			client_enc, std_string, datestyle, timezone);
+}
 
-	if (!res)
-		fatal("socket takeover failed - no mem?");
+static const char *get_opt_string(MBuf *pkt)
+{
+	const char *str = NULL;
+
+	if (mbuf_get_char(pkt)) {
+		str = mbuf_get_string(pkt);
+		if (!str)
+			fatal("broken string in FDS_BINARY row");
+	}
+	return str;
+}
+
+/* parse SHOW FDS_BINARY row, format is in admin.c */
+static void takeover_load_fd_batch(MBuf *pkt)
+{
+	const char *task = NULL, *user, *db;
+	const char *client_enc, *std_string, *datestyle, *timezone;
+	const uint8_t *data;
+	unsigned len, parse_ofs, pkt_remain;
+	uint8_t pkt_action, pin_flags;
+	int oldfd, linkfd, count;
+	uint64_t ckey;
+	PgSocket *sk;
+	PgAddr addr;
+	MBuf row;
+
+	/* single column */
+	if (mbuf_get_uint16(pkt) != 1)
+		fatal("bad FDS_BINARY row");
+	mbuf_slice(pkt, mbuf_get_uint32(pkt), &row);
+
+	count = mbuf_get_uint16(&row);
+	log_debug("FDS_BINARY row: %d sockets", count);
+	while (count-- > 0) {
+		memset(&addr, 0, sizeof(addr));
+		switch (mbuf_get_char(&row)) {
+		case 'c':
+			task = "client";
+			break;
+		case 's':
+			task = "server";
+			break;
+		case 'p':
+			task = "pooler";
+			break;
+		default:
+			fatal("bad task in FDS_BINARY row");
+		}
+		oldfd = mbuf_get_uint32(&row);
+		linkfd = mbuf_get_uint32(&row);
+		addr.is_unix = mbuf_get_char(&row);
+		memcpy(&addr.ip_addr, mbuf_get_bytes(&row, 4), 4);
+		addr.port = mbuf_get_uint16(&row);
+		ckey = mbuf_get_uint64(&row);
+		user = get_opt_string(&row);
+		db = get_opt_string(&row);
+		client_enc = get_opt_string(&row);
+		std_string = get_opt_string(&row);
+		datestyle = get_opt_string(&row);
+		timezone = get_opt_string(&row);
+		len = mbuf_get_uint32(&row);
+		parse_ofs = mbuf_get_uint32(&row);
+		pkt_remain = mbuf_get_uint32(&row);
+		pkt_action = mbuf_get_char(&row);
+		pin_flags = mbuf_get_char(&row);
+		data = mbuf_get_bytes(&row, len);
+
+		sk = takeover_use_fd(takeover_next_fd(), task, &addr, user, db,
+				     ckey, oldfd, linkfd, client_enc, std_string,
+				     datestyle, timezone);
+		if (!sk)
+			continue;
+
+		/* continue from where old process stopped */
+		if (len > 0 || pkt_remain > 0)
+			log_debug("fd %d: %u bytes buffered, pkt_remain=%u",
+				  oldfd, len, pkt_remain);
+		if (!sbuf_restore(&sk->sbuf, data, len, parse_ofs, pkt_remain, pkt_action))
+			fatal("cannot restore %u buffered bytes of fd %d, pkt_buf too small?",
+			      len, oldfd);
+		sk->pin_flags = pin_flags;
+	}
 }
 
 static void takeover_create_link(PgPool *pool, PgSocket *client)
@@ -145,6 +265,10 @@ static void takeover_create_link(PgPool *pool, PgSocket *client)
 		if (server->tmp_sk_oldfd == client->tmp_sk_linkfd) {
 			server->link = client;
 			client->link = server;
+
+			/* buffered data goes to the pair */
+			server->sbuf.dst = &client->sbuf;
+			client->sbuf.dst = &server->sbuf;
 			return;
 		}
 	}
@@ -197,8 +321,10 @@ static void next_command(PgSocket *bouncer, MBuf *pkt)
 
 	log_debug("takeover_recv_fds: 'C' body: %s", cmd);
 	if (strcmp(cmd, "SUSPEND") == 0) {
-		log_info("SUSPEND finished, sending SHOW FDS");
-		SEND_generic(res, bouncer, 'Q', "s", "SHOW FDS;");
+		suspend_buffers = false;
+		log_info("SUSPEND finished, sending SHOW FDS_BINARY");
+		binary_fds = true;
+		SEND_generic(res, bouncer, 'Q', "s", "SHOW FDS_BINARY;");
 	} else if (strncmp(cmd, "SHOW", 4) == 0) {
 		/* all fds loaded, review them */
 		takeover_postprocess_fds();
@@ -212,23 +338,48 @@ static void next_command(PgSocket *bouncer, MBuf *pkt)
 		fatal("command send failed");
 }
 
-static void takeover_parse_data(PgSocket *bouncer,
-				struct msghdr *msg, MBuf *data)
+/* old process does not know SUSPEND BUFFERS, wait for empty buffers then */
+static void fallback_suspend(PgSocket *bouncer)
+{
+	bool res;
+
+	log_info("old process does not support SUSPEND BUFFERS, sending SUSPEND");
+	suspend_buffers = false;
+	SEND_generic(res, bouncer, 'Q', "s", "SUSPEND;");
+	if (!res)
+		fatal("command send failed");
+}
+
+/* old process does not know SHOW FDS_BINARY */
+static void fallback_show_fds(PgSocket *bouncer)
+{
+	bool res;
+
+	log_info("old process does not support SHOW FDS_BINARY, sending SHOW FDS");
+	binary_fds = false;
+	SEND_generic(res, bouncer, 'Q', "s", "SHOW FDS;");
+	if (!res)
+		fatal("command send failed");
+}
+
+/* process complete packets, keep partial one for later */
+static void takeover_parse_data(PgSocket *bouncer)
 {
-	struct cmsghdr *cmsg;
 	PktHdr pkt;
-	
-	cmsg = msg->msg_controllen ? CMSG_FIRSTHDR(msg) : NULL;
+	MBuf data;
+	unsigned done = 0;
 
-	while (mbuf_avail(data) > 0) {
-		if (!get_header(data, &pkt))
+	mbuf_init(&data, recv_data, recv_len);
+	while (mbuf_avail(&data) > 0) {
+		if (!get_header(&data, &pkt)) {
+			if (mbuf_avail(&data) < NEW_HEADER_LEN)
+				break;
 			fatal("cannot parse packet");
+		}
 
-		/*
-		 * There should not be partial reads from UNIX socket.
-		 */
+		/* wait for rest of packet */
 		if (incomplete_pkt(&pkt))
-			fatal("unexpected partial packet");
+			break;
 
 		switch (pkt.type) {
 		case 'T': /* RowDescription */
@@ -236,11 +387,10 @@ static void takeover_parse_data(PgSocket *bouncer,
 			break;
 		case 'D': /* DataRow */
 			log_debug("takeover_parse_data: 'D'");
-			if (cmsg) {
-				takeover_load_fd(&pkt.data, cmsg);
-				cmsg = CMSG_NXTHDR(msg, cmsg);
-			} else
-				fatal("got row without fd info");
+			if (binary_fds)
+				takeover_load_fd_batch(&pkt.data);
+			else
+				takeover_load_fd(&pkt.data);
 			break;
 		case 'Z': /* ReadyForQuery */
 			log_debug("takeover_parse_data: 'Z'");
@@ -250,11 +400,48 @@ static void takeover_parse_data(PgSocket *bouncer,
 			next_command(bouncer, &pkt.data);
 			break;
 		case 'E': /* ErrorMessage */
+			if (suspend_buffers) {
+				fallback_suspend(bouncer);
+				break;
+			}
+			if (binary_fds) {
+				fallback_show_fds(bouncer);
+				break;
+			}
 			log_server_error("old bouncer sent", &pkt);
 			fatal("something failed");
 		default:
 			fatal("takeover_parse_data: unexpected pkt: '%c'", pkt_desc(&pkt));
 		}
+		done = recv_len - mbuf_avail(&data);
+	}
+
+	/* move partial packet to start */
+	memmove(recv_data, recv_data + done, recv_len - done);
+	recv_len -= done;
+
+	if (recv_fd_pos == recv_fd_count)
+		recv_fd_pos = recv_fd_count = 0;
+}
+
+/* remember fds from all ancillary messages */
+static void takeover_collect_fds(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	unsigned n;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			fatal("broken fd packet");
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (recv_fd_count + n > recv_fd_alloc) {
+			recv_fd_alloc = (recv_fd_count + n) * 2;
+			recv_fds = realloc(recv_fds, recv_fd_alloc * sizeof(int));
+			if (!recv_fds)
+				fatal("no mem for fds");
+		}
+		memcpy(recv_fds + recv_fd_count, CMSG_DATA(cmsg), n * sizeof(int));
+		recv_fd_count += n;
 	}
 }
 
@@ -266,16 +453,24 @@ static void takeover_parse_data(PgSocket *bouncer,
 static void takeover_recv_cb(int sock, short flags, void *arg)
 {
 	PgSocket *bouncer = container_of(arg, PgSocket, sbuf);
-	uint8_t data_buf[STARTUP_BUF * 2];
-	uint8_t cnt_buf[128];
+	uint8_t cnt_buf[CMSG_SPACE(sizeof(int) * TAKEOVER_MAX_FDS)];
 	struct msghdr msg;
 	struct iovec io;
 	int res;
-	MBuf data;
+
+	loop_callback(LOOP_RECV);
+
+	/* room for one more read */
+	if (recv_alloc - recv_len < STARTUP_BUF * 16) {
+		recv_alloc = recv_len + STARTUP_BUF * 64;
+		recv_data = realloc(recv_data, recv_alloc);
+		if (!recv_data)
+			fatal("no mem for takeover data");
+	}
 
 	memset(&msg, 0, sizeof(msg));
-	io.iov_base = data_buf;
-	io.iov_len = sizeof(data_buf);
+	io.iov_base = recv_data + recv_len;
+	io.iov_len = recv_alloc - recv_len;
 	msg.msg_iov = &io;
 	msg.msg_iovlen = 1;
 	msg.msg_control = cnt_buf;
@@ -283,8 +478,12 @@ static void takeover_recv_cb(int sock, short flags, void *arg)
 
 	res = safe_recvmsg(sock, &msg, 0);
 	if (res > 0) {
-		mbuf_init(&data, data_buf, res);
-		takeover_parse_data(bouncer, &msg, &data);
+		if (msg.msg_flags & MSG_CTRUNC)
+			fatal("fd info truncated");
+		if (msg.msg_controllen)
+			takeover_collect_fds(&msg);
+		recv_len += res;
+		takeover_parse_data(bouncer);
 	} else if (res == 0) {
 		fatal("unexpected EOF");
 	} else {
@@ -302,8 +501,9 @@ bool takeover_login(PgSocket *bouncer)
 {
 	bool res;
 
-	slog_info(bouncer, "Login OK, sending SUSPEND");
-	SEND_generic(res, bouncer, 'Q', "s", "SUSPEND;");
+	slog_info(bouncer, "Login OK, sending SUSPEND BUFFERS");
+	suspend_buffers = true;
+	SEND_generic(res, bouncer, 'Q', "s", "SUSPEND BUFFERS;");
 	if (res) {
 		/* use own callback */
 		if (!sbuf_pause(&bouncer->sbuf))
@@ -100,35 +100,49 @@ static void init_syslog(void)
 	syslog_started = 1;
 }
 
-static void write_syslog(const char *pfx, const char *msg)
+static int syslog_prio(const char *pfx)
 {
-	int prio = LOG_WARNING;
+	switch (pfx[0]) {
+	case 'F': return LOG_CRIT;
+	case 'E': return LOG_ERR;
+	case 'W': return LOG_WARNING;
+	case 'I': return LOG_INFO;
+	case 'L': return LOG_INFO;
+	case 'D': return LOG_DEBUG;
+	case 'N': return LOG_DEBUG;
+	}
+	return LOG_WARNING;
+}
 
+static void write_syslog(const char *pfx, const char *msg)
+{
 	if (!syslog_started)
 		init_syslog();
 
-	switch (pfx[0]) {
-	case 'F': prio = LOG_CRIT; break;
-	case 'E': prio = LOG_ERR; break;
-	case 'W': prio = LOG_WARNING; break;
-	case 'I': prio = LOG_INFO; break;
-	case 'L': prio = LOG_INFO; break;
-	case 'D': prio = LOG_DEBUG; break;
-	case 'N': prio = LOG_DEBUG; break;
-	}
-
-	syslog(prio, "%s", msg);
+	syslog(syslog_prio(pfx), "%s", msg);
 }
 
 void close_logfile(void)
 {
-	if (log_fd > 0) {
+	/* writer thread owns the logfile */
+	if (asynclog_active())
+		asynclog_reopen();
+	else if (log_fd > 0) {
 		close(log_fd);
 		log_fd = 0;
 	}
+	/* reopened on next line, with new syslog_ident/facility */
 	close_syslog();
 }
 
+/* log writer thread takes over logfile opened before user change */
+int logfile_handover(void)
+{
+	int fd = log_fd > 0 ? log_fd : -1;
+	log_fd = 0;
+	return fd;
+}
+
 static void write_logfile(const char *buf, int len)
 {
 	int res;
@@ -144,16 +158,46 @@ static void write_logfile(const char *buf, int len)
 		len = 0;
 }
 
+/* hand formatted line to log writer thread */
+static void _log_write_async(const char *pfx, const char *line, int len, int msg_ofs)
+{
+	int dest = 0;
+
+	if (cf_logfile[0])
+		dest |= ALOG_FILE;
+	if (cf_syslog) {
+		if (!syslog_started)
+			init_syslog();
+		dest |= ALOG_SYSLOG;
+	}
+	if (!cf_quiet)
+		dest |= ALOG_STDERR;
+	if (dest)
+		asynclog_write(line, len, msg_ofs, len - 1 - msg_ofs, dest, syslog_prio(pfx));
+}
+
 static void _log_write(const char *pfx, const char *msg)
 {
 	char buf[1024];
 	char tbuf[64];
-	int len;
+	int len, ofs;
 	int old_errno = errno;
 
 	render_time(tbuf, sizeof(tbuf));
-	len = snprintf(buf, sizeof(buf), "%s %u %s %s\n",
-			tbuf, (unsigned)getpid(), pfx, msg);
+	ofs = snprintf(buf, sizeof(buf), "%s %u %s ",
+			tbuf, (unsigned)getpid(), pfx);
+	len = ofs + snprintf(buf + ofs, sizeof(buf) - ofs, "%s\n", msg);
+	if (len >= (int)sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	if (asynclog_active()) {
+		_log_write_async(pfx, buf, len, ofs);
+		if (old_errno != errno)
+			errno = old_errno;
+		return;
+	}
 
 	if (cf_logfile[0])
 		write_logfile(buf, len);
@@ -625,6 +669,52 @@ void tune_socket(int sock, bool is_unix)
 		fatal_perror("setsockopt TCP_NODELAY");
 }
 
+/*
+ * Check idle connection without network round-trip.
+ *
+ * Idle server should not send anything, so pending data or EOF
+ * means it is unusable.  On TCP, also look at the connection state
+ * and unanswered retransmits or keepalive probes.
+ */
+bool check_socket_alive(int fd, bool is_unix, const char **reason_p)
+{
+	char c;
+	int res;
+
+	res = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (res == 0) {
+		*reason_p = "server closed connection";
+		return false;
+	} else if (res > 0) {
+		*reason_p = "unexpected data from server";
+		return false;
+	} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		*reason_p = strerror(errno);
+		return false;
+	}
+
+	/* struct tcp_info and TCP_ESTABLISHED (an enum, not macro) are Linux-only */
+#if defined(TCP_INFO) && defined(__linux__)
+	if (!is_unix) {
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+
+		res = getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+		if (res == 0) {
+			if (info.tcpi_state != TCP_ESTABLISHED) {
+				*reason_p = "bad tcp state";
+				return false;
+			}
+			if (info.tcpi_retransmits > 0 || info.tcpi_probes > 0) {
+				*reason_p = "unanswered tcp packets";
+				return false;
+			}
+		}
+	}
+#endif
+	return true;
+}
+
 /*
  * Find a string in comma-separated list.
  *
@@ -662,6 +752,25 @@ loop:
 	return true;
 }
 
+/*
+ * Copy next SQL keyword from query into buf, in lowercase.
+ * Returns position after it.
+ */
+const char *sql_next_word(const char *p, char *buf, unsigned buflen)
+{
+	unsigned len = 0;
+
+	while (*p && isspace((unsigned char)*p))
+		p++;
+	while (*p && (isalpha((unsigned char)*p) || *p == '_')) {
+		if (len < buflen - 1)
+			buf[len++] = tolower((unsigned char)*p);
+		p++;
+	}
+	buf[len] = 0;
+	return p;
+}
+
 const char *format_date(usec_t uval)
 {
 	static char buf[128];
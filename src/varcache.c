@@ -22,56 +22,222 @@
 
 #include "bouncer.h"
 
+/* interned parameter value */
+struct PStr {
+	PStr *next;		/* next in hash bucket */
+	int refcnt;
+	uint32_t hash;
+	int len;
+	char str[1];
+};
+
+/* tracked parameter */
 struct var_lookup {
 	const char *name;
-	int offset;
-	int len;
 };
 
-static const struct var_lookup lookup [] = {
- {"client_encoding",             offsetof(VarCache, client_encoding), VAR_ENCODING_LEN },
- {"datestyle",                   offsetof(VarCache, datestyle),       VAR_DATESTYLE_LEN },
- {"timezone",                    offsetof(VarCache, timezone),        VAR_TIMEZONE_LEN },
- {"standard_conforming_strings", offsetof(VarCache, std_strings),     VAR_STDSTR_LEN },
- {NULL},
+/* built-in parameters, always tracked */
+#define NUM_BUILTIN_VARS	4
+#define VAR_STD_STRINGS		3
+static const char *builtin_vars[] = {
+	"client_encoding",
+	"DateStyle",
+	"TimeZone",
+	"standard_conforming_strings",
+	NULL
 };
 
-static inline char *get_value(VarCache *cache, const struct var_lookup *lk)
+static struct var_lookup lookup[VARCACHE_MAX];
+static int num_vars;
+
+/* open-addressing index over lookup[], by lowercased name */
+#define VAR_INDEX_SIZE		(VARCACHE_MAX * 4)
+#define VAR_NAME_MAX		64
+static int var_index[VAR_INDEX_SIZE];
+
+/* interned values */
+#define PSTR_BUCKETS		1024
+static PStr *pstr_hash[PSTR_BUCKETS];
+
+static PStr *pstr_get(const char *str)
 {
-	return (char *)(cache) + lk->offset;
+	int len = strlen(str);
+	uint32_t hash = lookup3_hash(str, len);
+	PStr **bucket = &pstr_hash[hash % PSTR_BUCKETS];
+	PStr *p;
+
+	for (p = *bucket; p; p = p->next) {
+		if (p->hash == hash && p->len == len && memcmp(p->str, str, len) == 0) {
+			p->refcnt++;
+			return p;
+		}
+	}
+
+	p = malloc(offsetof(PStr, str) + len + 1);
+	if (!p)
+		return NULL;
+	p->refcnt = 1;
+	p->hash = hash;
+	p->len = len;
+	memcpy(p->str, str, len + 1);
+	p->next = *bucket;
+	*bucket = p;
+	return p;
 }
 
-bool varcache_set(VarCache *cache, const char *key, const char *value)
+static PStr *pstr_ref(PStr *p)
 {
-	int vlen;
-	char *pos;
-	const struct var_lookup *lk;
+	if (p)
+		p->refcnt++;
+	return p;
+}
 
-	/* convert NULL to empty string */
-	if (value == NULL)
-		value = "";
+static void pstr_put(PStr *p)
+{
+	PStr **pos;
 
-	for (lk = lookup; lk->name; lk++) {
-		if (strcasecmp(lk->name, key) != 0)
-			continue;
+	if (!p || --p->refcnt > 0)
+		return;
 
-		vlen = strlen(value);
-		if (vlen >= lk->len) {
-			log_warning("varcache_set overflow: %s", key);
-			return false;
+	for (pos = &pstr_hash[p->hash % PSTR_BUCKETS]; *pos; pos = &(*pos)->next) {
+		if (*pos == p) {
+			*pos = p->next;
+			break;
 		}
+	}
+	free(p);
+}
 
-		pos = get_value(cache, lk);
-		memcpy(pos, value, vlen + 1);
-		return true;
+/* replace value, takes over the reference */
+static void set_value(VarCache *cache, int idx, PStr *val)
+{
+	PStr *old = cache->var_list[idx];
+	cache->var_list[idx] = val;
+	pstr_put(old);
+}
+
+/* case-insensitive hash of name, *len_p is 0 if name is too long */
+static uint32_t name_hash(const char *name, int *len_p)
+{
+	char buf[VAR_NAME_MAX];
+	int len = 0;
+
+	*len_p = 0;
+	while (name[len]) {
+		if (len >= VAR_NAME_MAX)
+			return 0;
+		buf[len] = tolower((unsigned char)name[len]);
+		len++;
+	}
+	*len_p = len;
+	return lookup3_hash(buf, len);
+}
+
+/* returns index in lookup[] or -1 */
+static int find_var(const char *name)
+{
+	int len, slot, idx;
+	uint32_t hash = name_hash(name, &len);
+
+	if (len == 0)
+		return -1;
+
+	for (slot = hash % VAR_INDEX_SIZE; var_index[slot]; slot = (slot + 1) % VAR_INDEX_SIZE) {
+		idx = var_index[slot] - 1;
+		if (strcasecmp(lookup[idx].name, name) == 0)
+			return idx;
+	}
+	return -1;
+}
+
+static void add_var(const char *name)
+{
+	int len, slot;
+	uint32_t hash;
+
+	if (find_var(name) >= 0)
+		return;
+	if (num_vars >= VARCACHE_MAX) {
+		log_warning("too many tracked parameters, ignoring: %s", name);
+		return;
+	}
+	hash = name_hash(name, &len);
+	if (len == 0) {
+		log_warning("bad parameter name, ignoring: %s", name);
+		return;
+	}
+
+	for (slot = hash % VAR_INDEX_SIZE; var_index[slot]; slot = (slot + 1) % VAR_INDEX_SIZE)
+		;
+	lookup[num_vars].name = name;
+	var_index[slot] = ++num_vars;
+}
+
+/* register tracked parameters, must be called after config is loaded */
+void varcache_init(void)
+{
+	const char **b;
+	char *list, *tok, *save = NULL;
+
+	for (b = builtin_vars; *b; b++)
+		add_var(*b);
+
+	/* names are kept, so the copy is never freed */
+	list = strdup(cf_track_extra_params);
+	if (!list)
+		fatal("no mem for track_extra_parameters");
+	for (tok = strtok_r(list, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save))
+		add_var(tok);
+}
+
+/*
+ * Is parameter restored on server when client is linked?  Only ones
+ * that server reports back, others would be changed by SET behind
+ * varcache's back.  orig has what pool's servers reported.
+ */
+bool varcache_reported(VarCache *orig, const char *name)
+{
+	int idx = find_var(name);
+
+	if (idx < 0)
+		return false;
+	return idx < NUM_BUILTIN_VARS || (orig->set_mask & (1u << idx));
+}
+
+bool varcache_set(VarCache *cache, const char *key, const char *value)
+{
+	PStr *val = NULL;
+	int idx = find_var(key);
+
+	if (idx < 0)
+		return false;
+
+	/* empty string means unset */
+	if (value && *value) {
+		val = pstr_get(value);
+		if (!val)
+			log_warning("varcache_set: no mem for %s", key);
 	}
-	return false;
+	set_value(cache, idx, val);
+	cache->set_mask |= 1u << idx;
+	return true;
+}
+
+const char *varcache_get(VarCache *cache, const char *key)
+{
+	int idx = find_var(key);
+	PStr *val;
+
+	if (idx < 0)
+		return NULL;
+	val = cache->var_list[idx];
+	return val ? val->str : NULL;
 }
 
 static bool is_std_quote(VarCache *vars)
 {
-	const char *val = vars->std_strings;
-	return strcasecmp(val, "on") == 0;
+	PStr *val = vars->var_list[VAR_STD_STRINGS];
+	return val && strcasecmp(val->str, "on") == 0;
 }
 
 static bool quote_literal(char *buf, int buflen, const char *src, bool std_quote)
@@ -100,95 +266,162 @@ static bool quote_literal(char *buf, int buflen, const char *src, bool std_quote
 }
 
 static int apply_var(PktBuf *pkt, const char *key,
-		     const char *cval, const char *sval,
-		     bool std_quote)
+		     PStr *cval, bool builtin, bool std_quote)
 {
-	char buf[128];
-	char qbuf[128];
-	unsigned len;
+	char qbuf[STARTUP_BUF];
 
-	if (strcasecmp(cval, sval) == 0)
-		return 0;
-
-	/* if unset, ignore */
-	if (!*cval)
-		return 0;
+	/* client has no value, bring server back to default */
+	if (!cval) {
+		pktbuf_put_bytes(pkt, "RESET ", 6);
+		pktbuf_put_bytes(pkt, key, strlen(key));
+		pktbuf_put_char(pkt, ';');
+		return 1;
+	}
 
 	/* the string may have been taken from startup pkt */
-	if (!quote_literal(qbuf, sizeof(qbuf), cval, std_quote))
+	if (!quote_literal(qbuf, sizeof(qbuf), cval->str, std_quote)) {
+		log_warning("got too long value, skipping");
 		return 0;
+	}
 
-	/* add SET statement to packet */
-	len = snprintf(buf, sizeof(buf), "SET %s=%s;", key, qbuf);
-	if (len < sizeof(buf)) {
-		pktbuf_put_bytes(pkt, buf, len);
-		return 1;
+	/*
+	 * Add SET statement to packet.  Extra params may be lists
+	 * like search_path, where SET would quote the whole value
+	 * as single item, so set_config() is used for them.
+	 */
+	if (builtin) {
+		pktbuf_put_bytes(pkt, "SET ", 4);
+		pktbuf_put_bytes(pkt, key, strlen(key));
+		pktbuf_put_char(pkt, '=');
+		pktbuf_put_bytes(pkt, qbuf, strlen(qbuf));
+		pktbuf_put_char(pkt, ';');
 	} else {
-		log_warning("got too long value, skipping");
-		return 0;
+		pktbuf_put_bytes(pkt, "SELECT pg_catalog.set_config('", 30);
+		pktbuf_put_bytes(pkt, key, strlen(key));
+		pktbuf_put_bytes(pkt, "', ", 3);
+		pktbuf_put_bytes(pkt, qbuf, strlen(qbuf));
+		pktbuf_put_bytes(pkt, ", false);", 9);
 	}
+	return 1;
 }
 
-bool varcache_apply(PgSocket *server, PgSocket *client, bool *changes_p)
+/*
+ * Add SET statements for differing parameters to the packet,
+ * as one separate Query.  Returns true if something was added.
+ *
+ * Server values are updated immediately, as error in SET
+ * will drop the connection anyway.
+ */
+bool varcache_apply(PgSocket *server, PgSocket *client, PktBuf *dst)
 {
 	PktBuf pkt;
 	uint8_t buf[STARTUP_BUF];
-	int changes = 0;
-	const char *cval, *sval;
-	const struct var_lookup *lk;
-	uint8_t *debug_sql;
+	int i, changes = 0;
+	PStr *cval, *sval;
+	PStr **orig = server->pool->orig_vars.var_list;
 	bool std_quote = is_std_quote(&server->vars);
 
 	pktbuf_static(&pkt, buf, sizeof(buf));
-	pktbuf_start_packet(&pkt, 'Q');
 
-	/* grab quory position inside pkt */
-	debug_sql = pkt.buf + pkt.write_pos;
+	for (i = 0; i < num_vars; i++) {
+		sval = server->vars.var_list[i];
+		cval = client->vars.var_list[i];
+		if (cval == sval)
+			continue;
+
+		if (!apply_var(&pkt, lookup[i].name, cval, i < NUM_BUILTIN_VARS, std_quote))
+			continue;
+		changes++;
 
-	for (lk = lookup; lk->name; lk++) {
-		sval = get_value(&server->vars, lk);
-		cval = get_value(&client->vars, lk);
-		changes += apply_var(&pkt, lk->name, cval, sval, std_quote);
+		if (cval)
+			set_value(&server->vars, i, pstr_ref(cval));
+		else
+			set_value(&server->vars, i, pstr_ref(orig[i]));
 	}
-	*changes_p = changes > 0;
 	if (!changes)
-		return true;
+		return false;
 
 	pktbuf_put_char(&pkt, 0);
-	pktbuf_finish_packet(&pkt);
+	if (pkt.failed) {
+		log_warning("varcache_apply: too many changes");
+		dst->failed = 1;
+		return true;
+	}
+	slog_debug(server, "varcache_apply: %s", (char *)pkt.buf);
 
-	slog_debug(server, "varcache_apply: %s", debug_sql);
-	return pktbuf_send_immidiate(&pkt, server);
+	pktbuf_write_generic(dst, 'Q', "s", pkt.buf);
+	return true;
+}
+
+/*
+ * Hash of all values, so servers with matching parameters
+ * can be found without comparing strings.
+ */
+uint32_t varcache_hash(VarCache *cache)
+{
+	int i;
+	uint32_t hash = 0;
+	PStr *val;
+
+	for (i = 0; i < num_vars; i++) {
+		val = cache->var_list[i];
+		hash = hash32(hash ^ (val ? val->hash : (uint32_t)i));
+	}
+	return hash;
 }
 
 void varcache_fill_unset(VarCache *src, PgSocket *dst)
 {
-	char *srcval, *dstval;
-	const struct var_lookup *lk;
-	for (lk = lookup; lk->name; lk++) {
-		srcval = get_value(src, lk);
-		dstval = get_value(&dst->vars, lk);
-		if (!*dstval)
-			memcpy(dstval, srcval, lk->len);
+	int i;
+
+	for (i = 0; i < num_vars; i++) {
+		if (!dst->vars.var_list[i])
+			dst->vars.var_list[i] = pstr_ref(src->var_list[i]);
+	}
+}
+
+void varcache_copy(VarCache *dst, VarCache *src)
+{
+	int i;
+
+	for (i = 0; i < num_vars; i++)
+		set_value(dst, i, pstr_ref(src->var_list[i]));
+	dst->set_mask = src->set_mask;
+}
+
+/*
+ * After reset query, values that server does not report
+ * cannot be trusted anymore.  Reported ones are updated
+ * by ParameterStatus packets.
+ */
+void varcache_forget_unreported(VarCache *cache, VarCache *orig)
+{
+	int i;
+
+	for (i = 0; i < num_vars; i++) {
+		if (!(orig->set_mask & (1u << i)))
+			set_value(cache, i, NULL);
 	}
 }
 
 void varcache_clean(VarCache *cache)
 {
-	cache->client_encoding[0] = 0;
-	cache->datestyle[0] = 0;
-	cache->timezone[0] = 0;
-	cache->std_strings[0] = 0;
+	int i;
+
+	for (i = 0; i < num_vars; i++)
+		set_value(cache, i, NULL);
+	cache->set_mask = 0;
 }
 
 void varcache_add_params(PktBuf *pkt, VarCache *vars)
 {
-	char *val;
-	const struct var_lookup *lk;
-	for (lk = lookup; lk->name; lk++) {
-		val = get_value(vars, lk);
-		if (*val)
-			pktbuf_write_ParameterStatus(pkt, lk->name, val);
+	int i;
+	PStr *val;
+
+	for (i = 0; i < num_vars; i++) {
+		val = vars->var_list[i];
+		if (val)
+			pktbuf_write_ParameterStatus(pkt, lookup[i].name, val->str);
 	}
 }
 
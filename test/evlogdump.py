@@ -0,0 +1,120 @@
+#! /usr/bin/env python3
+
+"""Decode binary event log written by pgbouncer (event_log_file).
+
+Prints records from oldest to newest, as text or CSV.
+
+usage: evlogdump.py [-c] [-n LAST] [-t TYPE] event.log
+    -c       CSV output
+    -n LAST  only last LAST records
+    -t TYPE  only records of this type, eg. client_close
+"""
+
+import sys, struct, time, socket, getopt
+
+MAGIC = b'PGBEVLOG'
+
+# struct EvLogHeader in src/evlog.c
+HDR_FMT = '8sIIIIIIQQQ8x'
+# struct EvLogRecord in include/evlog.h
+REC_FMT = 'QIIIHBxHxxI'
+TEXT_LEN = 64
+
+TYPES = {
+    1: 'client_accept',
+    2: 'client_login',
+    3: 'client_close',
+    4: 'server_connect',
+    5: 'server_login',
+    6: 'server_close',
+    7: 'server_link',
+    8: 'server_release',
+    9: 'pool_create',
+    10: 'start',
+}
+
+CONN_KINDS = ['normal', 'cancel', 'listen', 'takeover']
+
+# what 'extra' means for each type
+EXTRA = {
+    'client_accept': 'takeover',
+    'client_login': 'login_usec',
+    'client_close': 'age_sec',
+    'server_connect': 'kind',
+    'server_login': 'login_usec',
+    'server_close': 'age_sec',
+    'server_link': 'server',
+    'server_release': 'client',
+    'start': 'pid',
+}
+
+def read_header(data):
+    for order in '<>':
+        fields = struct.unpack_from(order + HDR_FMT, data)
+        if fields[0] == MAGIC and fields[1] == 2:
+            return order, fields
+    raise Exception('not a pgbouncer event log')
+
+def format_time(usec):
+    t = time.localtime(usec // 1000000)
+    return time.strftime('%Y-%m-%d %H:%M:%S', t) + '.%06d' % (usec % 1000000)
+
+def main():
+    csv = False
+    last = None
+    only = None
+
+    opts, args = getopt.getopt(sys.argv[1:], 'cn:t:')
+    for o, v in opts:
+        if o == '-c': csv = True
+        elif o == '-n': last = int(v)
+        elif o == '-t': only = v
+    if len(args) != 1:
+        print(__doc__)
+        sys.exit(1)
+
+    data = open(args[0], 'rb').read()
+    order, hdr = read_header(data)
+    magic, version, header_size, rec_size, capacity, text_max, text_count, write_count, start_time, text_epoch = hdr
+
+    texts = {}
+    ofs = struct.calcsize(order + HDR_FMT)
+    for i in range(1, text_count):
+        raw = data[ofs + i * TEXT_LEN:ofs + (i + 1) * TEXT_LEN]
+        texts[i] = raw.split(b'\0')[0].decode(errors='replace')
+    texts[0xFFFF] = '(other)'
+
+    first = max(0, write_count - capacity)
+    if last is not None:
+        first = max(first, write_count - last)
+
+    if csv:
+        print('seq,time,type,sock,pool,addr,port,text,extra')
+    for seq in range(first, write_count):
+        pos = header_size + (seq % capacity) * rec_size
+        tm, sock, pool, addr, port, typ, text, extra = struct.unpack_from(order + REC_FMT, data, pos)
+        name = TYPES.get(typ, 'type%d' % typ)
+        if only and name != only:
+            continue
+        host = socket.inet_ntoa(struct.pack('=I', addr)) if addr else 'unix'
+        if not text:
+            txt = ''
+        elif seq < text_epoch:
+            txt = '(lost)'
+        else:
+            txt = texts.get(text, '')
+        if name == 'server_connect' and extra < len(CONN_KINDS):
+            extra = CONN_KINDS[extra]
+        if csv:
+            print('%d,%s,%s,%d,%d,%s,%d,"%s",%s' % (seq, format_time(tm), name, sock, pool,
+                  host, port, txt.replace('"', '""'), extra))
+        else:
+            line = '%s %-14s sock=%d pool=%d %s:%d' % (format_time(tm), name, sock, pool, host, port)
+            if name in EXTRA:
+                line += ' %s=%s' % (EXTRA[name], extra)
+            if txt:
+                line += ' "%s"' % txt
+            print(line)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,415 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ * 
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Packet forwarding benchmark for SBuf.
+ *
+ * Each pair of PgSockets is linked like client and server: packets
+ * written into client socket are forwarded by sbuf_prepare_send()
+ * to server socket, from where they are read back and checked.
+ * All sockets are socketpairs, so only pooler-side code is measured.
+ *
+ * Runs once with sockets and buffers from normal slabs and then
+ * from huge-page arena, reports time per packet for both.  On Linux
+ * also cache misses per packet are shown, from perf counters of
+ * user-space code.  Build it against different PgSocket layouts to
+ * compare them.
+ *
+ * usage: sbufbench [-n pairs] [-r rounds] [-s pkt_buf]
+ */
+
+#include "bouncer.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+
+/* variables needed by linked objects */
+int cf_verbose = 0;
+int cf_quiet = 0;
+int cf_syslog = 0;
+char *cf_syslog_facility = "daemon";
+char *cf_logfile = "";
+char *cf_jobname = "sbufbench";
+int cf_log_async_buffer = 0;
+int cf_listen_port = 0;
+int cf_pause_mode = P_NONE;
+int cf_reboot = 0;
+int cf_sbuf_len = 2048;
+int cf_sbuf_loopcnt = 5;
+int cf_tcp_socket_buffer = 0;
+int cf_tcp_defer_accept = 0;
+int cf_tcp_keepalive = 0;
+int cf_tcp_keepcnt = 0;
+int cf_tcp_keepidle = 0;
+int cf_tcp_keepintvl = 0;
+int cf_client_spool_size = 0;
+int cf_client_spool_file_size = 0;
+char *cf_client_spool_dir = "/tmp";
+ObjectCache *iobuf_cache;
+
+/* stream of packets written into each pair, repeated */
+#define PATTERN_SIZE	(256*1024)
+
+static uint8_t *pattern;
+static unsigned pattern_len;
+static unsigned pattern_pkts;
+
+struct Pair {
+	PgSocket *client;
+	PgSocket *server;
+	int wfd, rfd;
+	struct event wev, rev;
+	unsigned long sent, rcvd;
+};
+
+static ObjectCache *socket_cache;
+static PgPool bench_pool;
+static struct Pair *pairs;
+static int npairs = 1000;
+static int rounds = 20;
+static unsigned long total_bytes;
+static int pairs_done;
+
+static void make_pattern(void)
+{
+	unsigned len, i;
+	uint8_t *p;
+
+	pattern = malloc(PATTERN_SIZE + 64*1024);
+	if (!pattern)
+		fatal("no mem");
+	srandom(1);
+	while (pattern_len < PATTERN_SIZE) {
+		/* mostly small packets, some larger than buffer */
+		len = 5 + random() % (random() % 8 ? 200 : 3 * cf_sbuf_len);
+		p = pattern + pattern_len;
+		p[0] = 'D';
+		p[1] = (len - 1) >> 24;
+		p[2] = (len - 1) >> 16;
+		p[3] = (len - 1) >> 8;
+		p[4] = (len - 1);
+		for (i = 5; i < len; i++)
+			p[i] = i + pattern_pkts;
+		pattern_len += len;
+		pattern_pkts++;
+	}
+}
+
+/* forward everything from client to server */
+static bool fwd_proto(SBuf *sbuf, SBufEvent evtype, MBuf *data)
+{
+	PgSocket *client = container_of(sbuf, PgSocket, sbuf);
+	PgSocket *server = client->link;
+	unsigned len;
+
+	switch (evtype) {
+	case SBUF_EV_READ:
+		if (mbuf_avail(data) < NEW_HEADER_LEN)
+			return false;
+		mbuf_get_char(data);
+		len = mbuf_get_uint32(data);
+
+		/* fields that client_proto() uses on each query */
+		if (client->state != CL_ACTIVE || client->suspended || client->muxed)
+			fatal("bad client state");
+		if (server->state != SV_ACTIVE || server->close_needed)
+			fatal("bad server state");
+		if (!client->query_start)
+			client->query_start = get_cached_time();
+		client->request_time = get_cached_time();
+		client->pin_flags |= 0;
+		server->ready = 0;
+		client->pool->stats.client_bytes += len + 1;
+
+		sbuf_prepare_send(sbuf, &server->sbuf, len + 1);
+		return true;
+	case SBUF_EV_FLUSH:
+		return false;
+	default:
+		fatal("client sbuf event %d", evtype);
+	}
+	return false;
+}
+
+static bool sink_proto(SBuf *sbuf, SBufEvent evtype, MBuf *data)
+{
+	switch (evtype) {
+	case SBUF_EV_FLUSH:
+		return true;
+	default:
+		fatal("server sbuf event %d", evtype);
+	}
+	return false;
+}
+
+static void write_cb(int fd, short flags, void *arg)
+{
+	struct Pair *pair = arg;
+	unsigned long target = (unsigned long)pattern_len * rounds;
+	unsigned pos = pair->sent % pattern_len;
+	unsigned len = pattern_len - pos;
+	int res;
+
+	if (len > target - pair->sent)
+		len = target - pair->sent;
+	if (len > 16*1024)
+		len = 16*1024;
+	res = safe_send(fd, pattern + pos, len, 0);
+	if (res < 0) {
+		if (errno == EAGAIN)
+			return;
+		fatal_perror("send");
+	}
+	pair->sent += res;
+	if (pair->sent == target)
+		event_del(&pair->wev);
+}
+
+static void read_cb(int fd, short flags, void *arg)
+{
+	struct Pair *pair = arg;
+	uint8_t buf[16*1024];
+	unsigned pos, n;
+	int res, i;
+
+	res = safe_recv(fd, buf, sizeof(buf), 0);
+	if (res < 0) {
+		if (errno == EAGAIN)
+			return;
+		fatal_perror("recv");
+	}
+	if (res == 0)
+		fatal("unexpected eof");
+
+	/* data must arrive unchanged */
+	for (i = 0; i < res; i += n) {
+		pos = (pair->rcvd + i) % pattern_len;
+		n = pattern_len - pos;
+		if (n > (unsigned)(res - i))
+			n = res - i;
+		if (memcmp(buf + i, pattern + pos, n) != 0)
+			fatal("data mismatch");
+	}
+	pair->rcvd += res;
+	total_bytes += res;
+
+	if (pair->rcvd == (unsigned long)pattern_len * rounds) {
+		event_del(&pair->rev);
+		if (++pairs_done == npairs)
+			event_loopexit(NULL);
+	}
+}
+
+static PgSocket *new_socket(sbuf_cb_t proto, int fd)
+{
+	PgSocket *sk = obj_alloc(socket_cache);
+
+	if (!sk)
+		fatal("no mem for socket");
+	memset(sk, 0, sizeof(*sk));
+	sbuf_init(&sk->sbuf, proto);
+	if (!sbuf_accept(&sk->sbuf, fd, true))
+		fatal("sbuf_accept failed");
+	return sk;
+}
+
+static void setup_pair(struct Pair *pair)
+{
+	int cfd[2], sfd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, cfd) < 0
+	    || socketpair(AF_UNIX, SOCK_STREAM, 0, sfd) < 0)
+		fatal_perror("socketpair");
+
+	pair->client = new_socket(fwd_proto, cfd[1]);
+	pair->server = new_socket(sink_proto, sfd[0]);
+	pair->client->link = pair->server;
+	pair->server->link = pair->client;
+	pair->client->pool = pair->server->pool = &bench_pool;
+	pair->client->state = CL_ACTIVE;
+	pair->server->state = SV_ACTIVE;
+
+	pair->wfd = cfd[0];
+	pair->rfd = sfd[1];
+	socket_set_nonblocking(pair->wfd, 1);
+	socket_set_nonblocking(pair->rfd, 1);
+	pair->sent = pair->rcvd = 0;
+
+	event_set(&pair->wev, pair->wfd, EV_WRITE | EV_PERSIST, write_cb, pair);
+	event_set(&pair->rev, pair->rfd, EV_READ | EV_PERSIST, read_cb, pair);
+	if (event_add(&pair->wev, NULL) < 0 || event_add(&pair->rev, NULL) < 0)
+		fatal_perror("event_add");
+}
+
+static void close_pair(struct Pair *pair)
+{
+	if (!sbuf_close(&pair->client->sbuf) || !sbuf_close(&pair->server->sbuf))
+		fatal("sbuf_close failed");
+	obj_free(socket_cache, pair->client);
+	obj_free(socket_cache, pair->server);
+	safe_close(pair->wfd);
+	safe_close(pair->rfd);
+}
+
+/*
+ * Cache miss counters for user-space part of forwarding.
+ */
+
+enum { CNT_L1D, CNT_LLC, CNT_INSNS, NUM_CNT };
+static const char *const cnt_name[NUM_CNT] = { "L1d-miss", "LLC-miss", "insns" };
+static int cnt_fd[NUM_CNT] = { -1, -1, -1 };
+static bool cnt_tried;
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_start(void)
+{
+	int i;
+
+	if (!cnt_tried) {
+		cnt_tried = true;
+		cnt_fd[CNT_L1D] = open_counter(PERF_TYPE_HW_CACHE,
+					       PERF_COUNT_HW_CACHE_L1D
+					       | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					       | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+		cnt_fd[CNT_LLC] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		cnt_fd[CNT_INSNS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		if (cnt_fd[0] < 0)
+			log_info("perf counters not available: %s", strerror(errno));
+	}
+	for (i = 0; i < NUM_CNT; i++) {
+		if (cnt_fd[i] >= 0) {
+			ioctl(cnt_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(cnt_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static void counters_report(unsigned long pkts)
+{
+	uint64_t val;
+	int i;
+
+	if (cnt_fd[0] < 0)
+		return;
+	for (i = 0; i < NUM_CNT; i++) {
+		if (cnt_fd[i] < 0)
+			continue;
+		ioctl(cnt_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(cnt_fd[i], &val, sizeof(val)) != sizeof(val))
+			continue;
+		printf("  %s/pkt: %.2f", cnt_name[i], (double)val / pkts);
+	}
+	printf("\n");
+}
+#else
+static void counters_start(void) {}
+static void counters_report(unsigned long pkts) {}
+#endif
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void run(const char *desc, int flags)
+{
+	double start, total;
+	unsigned long pkts = (unsigned long)pattern_pkts * rounds * npairs;
+	int i;
+
+	socket_cache = objcache_create("bench_socket", sizeof(PgSocket), CACHELINE_SIZE, NULL, flags);
+	iobuf_cache = objcache_create("bench_iobuf", IOBUF_SIZE, 0, NULL, flags);
+	if (!socket_cache || !iobuf_cache)
+		fatal("cannot create caches");
+
+	total_bytes = 0;
+	pairs_done = 0;
+	for (i = 0; i < npairs; i++)
+		setup_pair(&pairs[i]);
+
+	counters_start();
+	start = now();
+	if (event_dispatch() < 0)
+		fatal_perror("event_dispatch");
+	total = now() - start;
+
+	printf("%-8s %d pairs, %lu pkts, %.1f MB: %.3f sec, %.1f ns/pkt, %.1f MB/s\n",
+	       desc, npairs, pkts, total_bytes / 1048576.0, total,
+	       total * 1e9 / pkts, total_bytes / 1048576.0 / total);
+	counters_report(pkts);
+
+	for (i = 0; i < npairs; i++)
+		close_pair(&pairs[i]);
+	objcache_destroy(socket_cache);
+	objcache_destroy(iobuf_cache);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:s:")) != EOF) {
+		switch (c) {
+		case 'n':
+			npairs = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			cf_sbuf_len = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n pairs] [-r rounds] [-s pkt_buf]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (npairs <= 0 || rounds <= 0 || cf_sbuf_len < 256)
+		fatal("bad arguments");
+
+	pairs = calloc(npairs, sizeof(*pairs));
+	if (!pairs)
+		fatal("no mem");
+	make_pattern();
+
+	if (!event_init())
+		fatal("event_init failed");
+
+	run("malloc", 0);
+	run("arena", OBJCACHE_ARENA);
+	return 0;
+}
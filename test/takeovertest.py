@@ -0,0 +1,128 @@
+#! /usr/bin/env python3
+
+"""Measure how long online restart keeps pooler suspended.
+
+Starts pgbouncer with generated config, opens N client connections,
+then runs 'pgbouncer -R' and reports time from SUSPEND to resume,
+as logged by new process.  Afterwards all clients must still work.
+
+Needs PostgreSQL that test.sh sets up (port 6666, db p0, trust auth).
+
+usage: takeovertest.py [-n N] [-b ../pgbouncer] [-p 6666] [-d p0] [-U bouncer]
+"""
+
+import sys, os, time, socket, struct, subprocess, tempfile, re, getopt
+
+def pkt(t, body):
+    return t + struct.pack('!i', len(body) + 4) + body
+
+def recv_msg(s):
+    hdr = b''
+    while len(hdr) < 5:
+        got = s.recv(5 - len(hdr))
+        if not got:
+            raise EOFError
+        hdr += got
+    n = struct.unpack('!i', hdr[1:])[0] - 4
+    body = b''
+    while len(body) < n:
+        got = s.recv(n - len(body))
+        if not got:
+            raise EOFError
+        body += got
+    return hdr[:1], body
+
+def wait_ready(s):
+    while True:
+        t, body = recv_msg(s)
+        if t == b'E':
+            raise Exception(body.decode(errors='replace'))
+        if t == b'Z':
+            return
+
+def connect(port, db, user):
+    s = socket.create_connection(('127.0.0.1', port))
+    params = b'user\0' + user.encode() + b'\0database\0' + db.encode() + b'\0\0'
+    body = struct.pack('!i', 196608) + params
+    s.sendall(struct.pack('!i', len(body) + 4) + body)
+    wait_ready(s)
+    return s
+
+def query(s, q):
+    s.sendall(pkt(b'Q', q.encode() + b'\0'))
+    wait_ready(s)
+
+def log_time(line):
+    m = re.match(r'(\d+-\d+-\d+ \d+:\d+:\d+)\.(\d+)', line)
+    t = time.mktime(time.strptime(m.group(1), '%Y-%m-%d %H:%M:%S'))
+    return t + int(m.group(2)) / 1000.0
+
+def main():
+    count = 1000
+    exe = os.path.abspath('../pgbouncer')
+    pgport = 6666
+    db = 'p0'
+    user = 'bouncer'
+    port = 6669
+
+    opts, args = getopt.getopt(sys.argv[1:], 'n:b:p:d:U:')
+    for o, v in opts:
+        if o == '-n': count = int(v)
+        elif o == '-b': exe = os.path.abspath(v)
+        elif o == '-p': pgport = int(v)
+        elif o == '-d': db = v
+        elif o == '-U': user = v
+
+    tmp = tempfile.mkdtemp(prefix='takeovertest.')
+    ini = os.path.join(tmp, 'takeover.ini')
+    log = os.path.join(tmp, 'takeover.log')
+    f = open(ini, 'w')
+    f.write('[databases]\n')
+    f.write('%s = host=127.0.0.1 port=%d dbname=%s user=%s\n' % (db, pgport, db, user))
+    f.write('[pgbouncer]\n')
+    f.write('listen_addr = 127.0.0.1\nlisten_port = %d\n' % port)
+    f.write('unix_socket_dir = %s\n' % tmp)
+    f.write('logfile = %s\npidfile = %s/takeover.pid\n' % (log, tmp))
+    f.write('auth_type = any\npool_mode = transaction\n')
+    f.write('max_client_conn = %d\ndefault_pool_size = 10\n' % (count + 10))
+    f.write('log_connections = 0\nlog_disconnections = 0\n')
+    if os.getuid() == 0:
+        f.write('user = nobody\n')
+        os.chmod(tmp, 0o777)
+    f.close()
+
+    subprocess.check_call([exe, '-d', ini])
+    time.sleep(1)
+
+    clients = []
+    for i in range(count):
+        clients.append(connect(port, db, user))
+    for s in clients[:10]:
+        query(s, 'select 1')
+    print('%d clients connected' % count)
+
+    subprocess.check_call([exe, '-d', '-R', ini])
+    start = end = None
+    for i in range(600):
+        for line in open(log):
+            if 'sending SUSPEND' in line:
+                start = log_time(line)
+            elif 'resuming work' in line:
+                end = log_time(line)
+        if end:
+            break
+        time.sleep(0.1)
+    if not start or not end:
+        print('takeover did not finish, see %s' % log)
+        sys.exit(1)
+    print('suspended for %.3f sec' % (end - start))
+
+    for s in clients:
+        query(s, 'select 1')
+    print('all clients ok')
+
+    pid = int(open(os.path.join(tmp, 'takeover.pid')).read())
+    os.kill(pid, 15)
+
+if __name__ == '__main__':
+    main()